@@ -9,21 +9,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/times.h>
 #include "clock.h"
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
 
 
 /******************************************************* 
  * Machine dependent functions 
  *
- * Note: the constants __i386__ and  __alpha
+ * Note: the constants __i386__, __x86_64__ and  __alpha
  * are set by GCC when it calls the C preprocessor
  * You can verify this for yourself using gcc -v.
  *******************************************************/
 
-#if defined(__i386__)  
+#if defined(__i386__) || defined(__x86_64__)
 /*******************************************************
- * Pentium versions of start_counter() and get_counter()
+ * Pentium and x86-64 versions of start_counter() and get_counter()
  *******************************************************/
 
 
@@ -33,14 +38,13 @@ static unsigned cyc_hi = 0;
 static unsigned cyc_lo = 0;
 
 
-/* Set *hi and *lo to the high and low order bits  of the cycle counter.  
-   Implementation requires assembly code to use the rdtsc instruction. */
+/* Set *hi and *lo to the high and low order bits  of the cycle counter. */
 void access_counter(unsigned *hi, unsigned *lo)
 {
-    asm("rdtsc; movl %%edx,%0; movl %%eax,%1"   /* Read cycle counter */
-	: "=r" (*hi), "=r" (*lo)                /* and move results to */
-	: /* No input */                        /* the two outputs */
-	: "%edx", "%eax");
+    unsigned long long tsc = __rdtsc();
+
+    *hi = (unsigned)(tsc >> 32);
+    *lo = (unsigned)tsc;
 }
 
 /* Record the current value of the cycle counter. */
@@ -71,6 +75,47 @@ double get_counter()
 }
 /* $end x86cyclecounter */
 
+/* 
+ * tsc_invariant - Does the TSC tick at a constant rate in every
+ *     P-, C- and T-state? (CPUID leaf 0x80000007, EDX bit 8)
+ */
+int tsc_invariant(void)
+{
+    unsigned eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+	return 0;
+    return (edx >> 8) & 1;
+}
+
+/* 
+ * tsc_begin - Read the TSC once every earlier instruction has
+ *     completed, and before any later one starts
+ */
+unsigned long long tsc_begin(void)
+{
+    unsigned long long tsc;
+
+    _mm_lfence();
+    tsc = __rdtsc();
+    _mm_lfence();
+    return tsc;
+}
+
+/* 
+ * tsc_end - Read the TSC with rdtscp, which waits for the timed code
+ *     to finish, and keep later instructions from starting early
+ */
+unsigned long long tsc_end(void)
+{
+    unsigned long long tsc;
+    unsigned aux;
+
+    tsc = __rdtscp(&aux);
+    _mm_lfence();
+    return tsc;
+}
+
 #elif defined(__alpha)
 
 /****************************************************
@@ -160,6 +205,24 @@ double get_counter()
 }
 #endif
 
+#if !defined(__i386__) && !defined(__x86_64__)
+/* No TSC to offer: fsecs falls back to clock_gettime */
+int tsc_invariant(void)
+{
+    return 0;
+}
+
+unsigned long long tsc_begin(void)
+{
+    return 0;
+}
+
+unsigned long long tsc_end(void)
+{
+    return 0;
+}
+#endif
+
 
 
 
@@ -201,6 +264,48 @@ double mhz(int verbose)
     return mhz_full(verbose, 2);
 }
 
+#define TSCROUNDS 5               /* calibration rounds, median wins */
+#define TSCSPIN   0.01            /* seconds per calibration round */
+
+/* Seconds on CLOCK_MONOTONIC_RAW, which NTP never slews */
+static double raw_secs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* 
+ * tsc_mhz - Calibrate the TSC rate against CLOCK_MONOTONIC_RAW. Takes
+ *     the median of TSCROUNDS short spins rather than sleeping for
+ *     seconds like mhz().
+ */
+
+double tsc_mhz(int verbose)
+{
+    double rate[TSCROUNDS], t0, t1, tmp;
+    unsigned long long c0, c1;
+    int i, j;
+
+    for (i = 0; i < TSCROUNDS; i++) {
+	t0 = raw_secs();
+	c0 = tsc_begin();
+	while ((t1 = raw_secs()) - t0 < TSCSPIN)
+	    ;
+	c1 = tsc_end();
+	rate[i] = (c1 - c0) / (1e6 * (t1 - t0));
+	for (j = i; j > 0 && rate[j-1] > rate[j]; j--) {
+	    tmp = rate[j-1];
+	    rate[j-1] = rate[j];
+	    rate[j] = tmp;
+	}
+    }
+    if (verbose)
+	printf("TSC rate ~= %.1f MHz\n", rate[TSCROUNDS/2]);
+    return rate[TSCROUNDS/2];
+}
+
 /** Special counters that compensate for timer interrupt overhead */
 
 static double cyc_per_tick = 0.0;
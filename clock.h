@@ -15,6 +15,17 @@ double mhz(int verbose);
 /* Determine clock rate of processor, having more control over accuracy */
 double mhz_full(int verbose, int sleeptime);
 
+/* Is the TSC invariant, i.e. usable as a wall clock? (0 if no TSC) */
+int tsc_invariant(void);
+
+/* Serialized TSC reads to bracket the timed code: tsc_begin() before
+   it, tsc_end() (rdtscp) after it */
+unsigned long long tsc_begin(void);
+unsigned long long tsc_end(void);
+
+/* TSC rate calibrated against CLOCK_MONOTONIC_RAW, in MHz */
+double tsc_mhz(int verbose);
+
 /** Special counters that compensate for timer interrupt overhead */
 
 void start_comp_counter();
@@ -67,9 +67,14 @@
 #define UTIL_WEIGHT .60
 
 /* 
- * Alignment requirement in bytes (either 4 or 8) 
+ * Alignment requirement in bytes: 8 in a 32-bit build, 16 in a 64-bit
+ * build so payloads can hold SSE/AVX data
  */
+#ifdef __LP64__
+#define ALIGNMENT 16
+#else
 #define ALIGNMENT 8  
+#endif
 
 /* 
  * Maximum heap size in bytes 
@@ -77,10 +82,22 @@
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
 
 /*****************************************************************************
- * Set exactly one of these USE_xxx constants to "1" to select a timing method
+ * Set exactly one of these USE_xxx constants to "1" to select the default
+ * timing method. mdriver -c <timer> picks another one at run time.
  *****************************************************************************/
 #define USE_FCYC   0   /* cycle counter w/K-best scheme (x86 & Alpha only) */
 #define USE_ITIMER 0   /* interval timer (any Unix box) */
-#define USE_GETTOD 1   /* gettimeofday (any Unix box) */
+#define USE_GETTOD 0   /* gettimeofday (any Unix box) */
+#define USE_CLOCK  1   /* clock_gettime(CLOCK_MONOTONIC_RAW) (any Linux box) */
+#define USE_TSC    0   /* serialized rdtscp, invariant TSC only (x86 only) */
+
+/*
+ * Set LATENCY_HIST to 1 to time every call in eval_mm_speed with the
+ * cycle counter (x86 & Alpha only) and print per-op latency percentiles.
+ * At 0 the per-call timing is compiled out.
+ */
+#ifndef LATENCY_HIST
+#define LATENCY_HIST 0
+#endif
 
 #endif /* __CONFIG_H */
@@ -123,6 +123,14 @@ static void clear()
     sink = x;
 }
 
+/* 
+ * fcyc_clear_cache - Clear the cache now, for timers other than fcyc 
+ */
+void fcyc_clear_cache(void)
+{
+    clear();
+}
+
 /*
  * fcyc - Use K-best scheme to estimate the running time of function f
  */
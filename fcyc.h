@@ -36,6 +36,12 @@ void set_fcyc_cache_size(int bytes);
  */
 void set_fcyc_cache_block(int bytes);
 
+/* 
+ * fcyc_clear_cache - Clear the cache now, the way fcyc does before each
+ *     measurement when set_fcyc_clear_cache is on
+ */
+void fcyc_clear_cache(void);
+
 /* 
  * set_fcyc_compensate- When set, will attempt to compensate for 
  *     timer interrupt overhead 
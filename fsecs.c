@@ -2,16 +2,163 @@
  * High-level timing wrappers
  ****************************/
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include "fsecs.h"
 #include "fcyc.h"
 #include "clock.h"
 #include "ftimer.h"
 #include "config.h"
 
+/* The timers fsecs can measure with */
+#define TIMER_FCYC   0
+#define TIMER_ITIMER 1
+#define TIMER_GETTOD 2
+#define TIMER_CLOCK  3
+#define TIMER_TSC    4
+
+#define REPS 10      /* runs of f per measurement */
+#define LINE 64      /* cache line size assumed for flushing and pollution */
+#define DEFAULT_LLC (32 << 20) /* cache size if the system won't tell */
+
+static char *timer_names[] = {"fcyc", "itimer", "gettod", "clock", "tsc"};
+
+#if USE_FCYC
+static int timer = TIMER_FCYC;
+#elif USE_ITIMER
+static int timer = TIMER_ITIMER;
+#elif USE_GETTOD
+static int timer = TIMER_GETTOD;
+#elif USE_TSC
+static int timer = TIMER_TSC;
+#else
+static int timer = TIMER_CLOCK;
+#endif
+
 static double Mhz;  /* estimated CPU clock frequency */
 
+static int cache_mode = FSECS_DEFAULT;
+static size_t cache_bytes;      /* flush and pollution buffer size */
+static volatile char *pollute_buf;
+static volatile int pollute_stop;
+static pthread_t polluter;
+
 extern int verbose; /* -v option in mdriver.c */
 
+/*
+ * set_fsecs_timer - select a timer by name before init_fsecs; returns
+ *     -1 if there is no timer of that name
+ */
+int set_fsecs_timer(char *name)
+{
+    int i;
+
+    for (i = 0; i < sizeof(timer_names) / sizeof(char *); i++) {
+	if (!strcmp(name, timer_names[i])) {
+	    timer = i;
+	    return 0;
+	}
+    }
+    return -1;
+}
+
+/*
+ * llc_bytes - the size of the last level cache, from sysconf or sysfs
+ */
+static size_t llc_bytes(void)
+{
+    long bytes = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    FILE *fp;
+    char unit = 0;
+
+    if (bytes > 0)
+	return bytes;
+    if ((fp = fopen("/sys/devices/system/cpu/cpu0/cache/index3/size", "r"))) {
+	if (fscanf(fp, "%ld%c", &bytes, &unit) < 1)
+	    bytes = 0;
+	fclose(fp);
+	if (unit == 'K')
+	    bytes <<= 10;
+	else if (unit == 'M')
+	    bytes <<= 20;
+	if (bytes > 0)
+	    return bytes;
+    }
+    return DEFAULT_LLC;
+}
+
+/*
+ * set_fsecs_cache - select the cache state f is timed in, and the size
+ *     of the buffer that flushes or pollutes the cache (0 for the size
+ *     of the last level cache)
+ */
+void set_fsecs_cache(int mode, size_t bytes)
+{
+    cache_mode = mode;
+    if (bytes == 0)
+	bytes = llc_bytes();
+    if (bytes != cache_bytes) {
+	cache_bytes = bytes;
+	set_fcyc_cache_size(bytes);
+	set_fcyc_cache_block(LINE);
+	free((char *)pollute_buf);
+	pollute_buf = NULL;
+    }
+}
+
+/*
+ * pollute - Thread routine that dirties a cache-sized buffer, one line
+ *     at a time, until told to stop
+ */
+static void *pollute(void *arg)
+{
+    size_t i;
+
+    while (!pollute_stop)
+	for (i = 0; i < cache_bytes && !pollute_stop; i += LINE)
+	    pollute_buf[i]++;
+    return NULL;
+}
+
+/*
+ * pollute_start - Start the polluter thread
+ */
+static void pollute_start(void)
+{
+    if (pollute_buf == NULL && 
+	(pollute_buf = calloc(1, cache_bytes)) == NULL) {
+	fprintf(stderr, "Fatal error.  No memory for the cache polluter\n");
+	exit(1);
+    }
+    pollute_stop = 0;
+    if (pthread_create(&polluter, NULL, pollute, NULL) != 0) {
+	fprintf(stderr, "Fatal error.  Could not start the cache polluter\n");
+	exit(1);
+    }
+}
+
+/*
+ * pollute_end - Stop the polluter thread
+ */
+static void pollute_end(void)
+{
+    pollute_stop = 1;
+    pthread_join(polluter, NULL);
+}
+
+/*
+ * fsecs_timer_name - the name of the timer in use
+ */
+char *fsecs_timer_name(void)
+{
+    return timer_names[timer];
+}
+
 /*
  * init_fsecs - initialize the timing package
  */
@@ -19,39 +166,147 @@ void init_fsecs(void)
 {
     Mhz = 0; /* keep gcc -Wall happy */
 
-#if USE_FCYC
-    if (verbose)
-	printf("Measuring performance with a cycle counter.\n");
-
-    /* set key parameters for the fcyc package */
-    set_fcyc_maxsamples(20); 
-    set_fcyc_clear_cache(1);
-    set_fcyc_compensate(1);
-    set_fcyc_epsilon(0.01);
-    set_fcyc_k(3);
-    Mhz = mhz(verbose > 0);
-#elif USE_ITIMER
-    if (verbose)
-	printf("Measuring performance with the interval timer.\n");
-#elif USE_GETTOD
-    if (verbose)
-	printf("Measuring performance with gettimeofday().\n");
-#endif
+    /* rdtscp only measures time if the TSC rate never changes */
+    if (timer == TIMER_TSC && !tsc_invariant()) {
+	printf("No invariant TSC, measuring with clock_gettime() instead.\n");
+	timer = TIMER_CLOCK;
+    }
+
+    switch (timer) {
+    case TIMER_FCYC:
+	if (verbose)
+	    printf("Measuring performance with a cycle counter.\n");
+
+	/* set key parameters for the fcyc package */
+	set_fcyc_maxsamples(20);
+	set_fcyc_clear_cache(1);
+	set_fcyc_compensate(1);
+	set_fcyc_epsilon(0.01);
+	set_fcyc_k(3);
+	Mhz = tsc_invariant() ? tsc_mhz(verbose > 0) : mhz(verbose > 0);
+	break;
+    case TIMER_ITIMER:
+	if (verbose)
+	    printf("Measuring performance with the interval timer.\n");
+	break;
+    case TIMER_GETTOD:
+	if (verbose)
+	    printf("Measuring performance with gettimeofday().\n");
+	break;
+    case TIMER_CLOCK:
+	if (verbose)
+	    printf("Measuring performance with clock_gettime().\n");
+	break;
+    case TIMER_TSC:
+	if (verbose)
+	    printf("Measuring performance with rdtscp.\n");
+	Mhz = tsc_mhz(verbose > 0);
+	break;
+    }
 }
 
 /*
- * fsecs - Return the running time of a function f (in seconds)
+ * time_once - Return the running time of one call of f (in seconds)
+ *     with one of the timers that can measure a single run
  */
-double fsecs(fsecs_test_funct f, void *argp) 
+static double time_once(fsecs_test_funct f, void *argp)
 {
-#if USE_FCYC
-    double cycles = fcyc(f, argp);
-    return cycles/(Mhz*1e6);
-#elif USE_ITIMER
-    return ftimer_itimer(f, argp, 10);
-#elif USE_GETTOD
-    return ftimer_gettod(f, argp, 10);
-#endif 
+    struct timeval stv, etv;
+    struct timespec sts, ets;
+    unsigned long long start;
+
+    switch (timer) {
+    case TIMER_ITIMER:
+	return ftimer_itimer(f, argp, 1);
+    case TIMER_GETTOD:
+	gettimeofday(&stv, NULL);
+	f(argp);
+	gettimeofday(&etv, NULL);
+	return (etv.tv_sec - stv.tv_sec) + 1E-6*(etv.tv_usec - stv.tv_usec);
+    case TIMER_TSC:
+	start = tsc_begin();
+	f(argp);
+	return (tsc_end() - start) / (Mhz*1e6);
+    default:
+	clock_gettime(CLOCK_MONOTONIC_RAW, &sts);
+	f(argp);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ets);
+	return (ets.tv_sec - sts.tv_sec) + 1E-9*(ets.tv_nsec - sts.tv_nsec);
+    }
 }
 
+/*
+ * fsecs_t95 - two-sided 95% quantile of Student's t with df degrees of
+ *     freedom
+ */
+double fsecs_t95(int df)
+{
+    static double t[] = {12.706, 4.303, 3.182, 2.776, 2.571,
+			 2.447, 2.365, 2.306, 2.262, 2.228};
+
+    if (df < 1)
+	df = 1;
+    if (df <= 10)
+	return t[df-1];
+    return (df <= 30) ? 2.1 : 1.96;
+}
+
+/*
+ * fsecs_stats - Return the mean running time of f (in seconds), and
+ *     fill in stats with the spread of the runs behind it. The fcyc
+ *     timer only yields one number per measurement, so for it reps is
+ *     1 and ci is 0. Every run starts in the cache state chosen with
+ *     set_fsecs_cache.
+ */
+double fsecs_stats(fsecs_test_funct f, void *argp, fsecs_stats_t *stats)
+{
+    double t[REPS], tmp, sum = 0, var = 0;
+    int i, j, n = 1;
+
+    if (cache_mode == FSECS_WARM || cache_mode == FSECS_POLLUTED)
+	f(argp);
+    if (cache_mode == FSECS_POLLUTED)
+	pollute_start();
 
+    switch (timer) {
+    case TIMER_FCYC:
+	set_fcyc_clear_cache(cache_mode == FSECS_DEFAULT || 
+			     cache_mode == FSECS_COLD);
+	t[0] = fcyc(f, argp) / (Mhz*1e6);
+	break;
+    default:
+	for (n = 0; n < REPS; n++) {
+	    if (cache_mode == FSECS_COLD)
+		fcyc_clear_cache();
+	    t[n] = time_once(f, argp);
+	    for (j = n; j > 0 && t[j-1] > t[j]; j--) {
+		tmp = t[j-1];
+		t[j-1] = t[j];
+		t[j] = tmp;
+	    }
+	}
+	break;
+    }
+    if (cache_mode == FSECS_POLLUTED)
+	pollute_end();
+
+    for (i = 0; i < n; i++)
+	sum += t[i];
+    stats->reps = n;
+    stats->mean = sum / n;
+    stats->median = (n % 2) ? t[n/2] : (t[n/2 - 1] + t[n/2]) / 2;
+    for (i = 0; i < n; i++)
+	var += (t[i] - stats->mean) * (t[i] - stats->mean);
+    stats->ci = (n > 1) ? fsecs_t95(n - 1) * sqrt(var / (n - 1) / n) : 0;
+    return stats->mean;
+}
+
+/*
+ * fsecs - Return the running time of a function f (in seconds)
+ */
+double fsecs(fsecs_test_funct f, void *argp)
+{
+    fsecs_stats_t stats;
+
+    return fsecs_stats(f, argp, &stats);
+}
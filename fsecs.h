@@ -1,4 +1,25 @@
+#include <stddef.h>
+
 typedef void (*fsecs_test_funct)(void *);
 
+/* The spread of the repetitions behind one fsecs measurement */
+typedef struct {
+    int reps;        /* runs of f timed one at a time */
+    double mean;     /* secs per run */
+    double median;
+    double ci;       /* half-width of the 95% confidence interval of mean */
+} fsecs_stats_t;
+
+/* The cache state fsecs times f in */
+#define FSECS_DEFAULT  0 /* whatever the previous run left behind */
+#define FSECS_COLD     1 /* cache flushed before every run */
+#define FSECS_WARM     2 /* after an untimed warm-up run */
+#define FSECS_POLLUTED 3 /* warm, with another thread streaming through memory */
+
+int set_fsecs_timer(char *name);
+void set_fsecs_cache(int mode, size_t bytes);
+char *fsecs_timer_name(void);
 void init_fsecs(void);
 double fsecs(fsecs_test_funct f, void *argp);
+double fsecs_stats(fsecs_test_funct f, void *argp, fsecs_stats_t *stats);
+double fsecs_t95(int df);
@@ -0,0 +1,163 @@
+/*
+ * libmm.c - The mm.c package as the process's malloc, for LD_PRELOAD
+ *
+ *     LD_PRELOAD=./libmm.so program ...
+ *
+ * The C library's allocation calls are served by mm.c on a memlib heap
+ * of real anonymous memory, reserved up front and committed as the brk
+ * moves. The heap reserves MM_HEAP_MB megabytes of address space,
+ * taken from the environment (default DEFAULT_HEAP_MB, at most 4095
+ * since mm.c links blocks by 32-bit heap offsets). Requests too large
+ * for the heap go to mappings of their own as usual. memlib's
+ * mem_resident is never called here: it allocates with malloc.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define DEFAULT_HEAP_MB 1024
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static int init_failed;
+
+/*
+ * init - Reserve the heap and start mm.c, once per process
+ */
+static void init(void)
+{
+    char *mb = getenv("MM_HEAP_MB");
+    size_t heap_mb = DEFAULT_HEAP_MB;
+
+    if (mb != NULL && atol(mb) > 0 && atol(mb) < 4096)
+	heap_mb = atol(mb);
+    mem_init_size(heap_mb << 20, 0);
+    init_failed = mm_init() < 0;
+}
+
+/*
+ * ready - Make sure the package is initialized; returns 0 if it could
+ *     not be
+ */
+static int ready(void)
+{
+    pthread_once(&init_once, init);
+    return !init_failed;
+}
+
+void *malloc(size_t size)
+{
+    void *p;
+
+    if (!ready())
+	return NULL;
+
+    /* mm_malloc(0) fails, but callers expect a block they can free */
+    if ((p = mm_malloc(size ? size : 1)) == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (ptr != NULL)
+	mm_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *p;
+
+    if (ptr == NULL)
+	return malloc(size);
+    if (size == 0) {
+	mm_free(ptr);
+	return NULL;
+    }
+    if ((p = mm_realloc(ptr, size)) == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    size_t bytes = nmemb * size;
+    void *p;
+
+    if (size && nmemb > (size_t)-1 / size) {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    /* Not malloc, or gcc turns malloc and memset back into calloc */
+    if (!ready() || (p = mm_malloc(bytes ? bytes : 1)) == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    memset(p, 0, bytes);
+    return p;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    if (size && nmemb > (size_t)-1 / size) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+	return EINVAL;
+    if (!ready() || (p = mm_memalign(alignment, size ? size : 1)) == NULL)
+	return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    void *p = NULL;
+
+    if (alignment & (alignment - 1)) {
+	errno = EINVAL;
+	return NULL;
+    }
+    if (!ready() || (p = mm_memalign(alignment, size ? size : 1)) == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+
+    if (size > (size_t)-1 - pagesize) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return memalign(pagesize, (size + pagesize-1) & ~(pagesize-1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    return ptr != NULL ? mm_usable_size(ptr) : 0;
+}
@@ -14,12 +14,26 @@
 #include <string.h>
 #include <assert.h>
 #include <float.h>
+#include <math.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "perfctr.h"
 #include "config.h"
+#include "trace.h"
+#if LATENCY_HIST
+#include "clock.h"
+#endif
 
 /**********************
  * Constants and macros
@@ -29,27 +43,34 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define RSSSAMPLES 10000 /* max resident heap samples per trace in eval_mm_util */
+#define FRAGINTERVAL 1000 /* default ops between fragmentation samples (-i) */
+#define CACHEMODES     3 /* cache states timed by -C: cold, warm, polluted */
+#define MAXBACKENDS    8 /* allocator builds compared in one run (-b) */
+#define REGRESSPCT     5 /* default slowdown that fails a comparison (-R) */
+#define REGIONSPAN   100 /* trace ops each region of -r lives for */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((size_t)(p)) % ALIGNMENT) == 0)
 
 /****************************** 
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* 
+ * Records the extent of each block's payload. The records form a treap
+ * keyed on lo: a binary search tree on lo that is also a heap on the
+ * random prio, so it stays balanced in expectation.
+ */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* ranges below lo; next free record in the pool */
+    struct range_t *right; /* ranges above lo */
+    unsigned prio;         /* treap priority */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
+#define RANGEPOOL 1024     /* range records carved from one malloc */
 
 /* Holds the information for one trace file*/
 typedef struct {
@@ -60,6 +81,9 @@ typedef struct {
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    void *map;           /* mmapped binary trace file, NULL for text */
+    size_t map_size;
+    int threaded;        /* some request carries a thread tag */
 } trace_t;
 
 /* 
@@ -77,14 +101,118 @@ typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
     double ops;      /* number of ops (malloc/free/realloc) in the trace */
     int valid;       /* was the trace processed correctly by the allocator? */
-    double secs;     /* number of secs needed to run the trace */
+    double secs;     /* number of secs needed to run the trace (mean) */
+    double median;   /* median secs of the timed repetitions */
+    double ci;       /* 95% confidence half-width of secs */
+    int reps;        /* timed repetitions behind secs and ci (set by -b) */
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double rss;      /* peak resident heap bytes for this trace (0 for libc) */
+
+    /* defined only with -p */
+    double events[PERF_EVENTS]; /* hardware events in one speed run, or -1 */
+
+    /* defined only with -C */
+    double cache_secs[CACHEMODES]; /* secs when cold, warm and polluted */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* 
+ * What a -j worker reports back over its pipe. Each worker is a forked
+ * process, so it has a private memlib instance and mm.c state.
+ */
+typedef struct {
+    int valid;       /* eval_mm_valid result */
+    double util;     /* eval_mm_util result (0 unless valid) */
+    double rss;      /* peak resident heap bytes */
+    int errors;      /* errors the worker counted */
+} jobresult_t;
+
+/* Summarizes a multithreaded replay (-T) of some malloc function on some trace */
+typedef struct {
+    double ops;      /* ops replayed by all threads together */
+    int valid;       /* did every thread run to completion? */
+    double secs;     /* wall clock secs from the common start to the last thread */
+    double min_lat;  /* smallest per-thread average latency (usecs/op) */
+    double avg_lat;  /* mean of the per-thread average latencies */
+    double max_lat;  /* largest per-thread average latency */
+} mtstats_t;
+
+/* The params to mt_replay, one struct per replay thread */
+typedef struct {
+    trace_t *trace;
+    int tid;                     /* thread number in [0, nthreads) */
+    int nthreads;
+    int partition;               /* replay only ids with id%nthreads == tid */
+    int use_mm;                  /* mm package if set, else libc malloc */
+    char **blocks;               /* this thread's blocks for the trace ids */
+    pthread_barrier_t *barrier;  /* releases all threads at once */
+    double ops;                  /* ops replayed by this thread */
+    double start;                /* wall clock time this thread started */
+    double secs;                 /* time this thread needed for them */
+    int failed;                  /* an allocation request failed */
+
+    /* Shared by all threads replaying a trace with thread tags (-P) */
+    int *opseq;                  /* ordinal of each request among its id's */
+    int *done;                   /* requests carried out on each id so far */
+    int *abort;                  /* set once any thread has failed */
+} mtarg_t;
+
+#if LATENCY_HIST
+/* 
+ * Log-bucketed latency histogram: values below 8 cycles get a bucket
+ * each, and every power of two above is split into 8 buckets, so a
+ * percentile is accurate to within 12.5%.
+ */
+#define HISTSUB     8
+#define HISTBUCKETS (64 * HISTSUB)
+typedef struct {
+    unsigned long count[HISTBUCKETS];
+    unsigned long n;             /* calls recorded */
+    double max;                  /* slowest call in cycles */
+} hist_t;
+
+/* Latency summary of one op type on one trace, in cycles */
+typedef struct {
+    unsigned long calls;
+    double p50, p99, p999, max;
+} latstats_t;
+
+static hist_t lat_hist[3];       /* per op type while timing one trace */
+
+/* Time one mm call of the given op type into lat_hist */
+#define TIMED(type, call) do { start_counter(); call; \
+	hist_add(&lat_hist[type], get_counter()); } while (0)
+#else
+#define TIMED(type, call) call
+#endif
+
+/* 
+ * An allocator package the driver can run: the mm.o linked into it, or
+ * a build of mm.c (or any allocator with its interface) loaded with -b
+ * from a shared object, whose memlib calls land in the driver's heap.
+ */
+typedef struct {
+    char *name;          /* "builtin" or the shared object's path */
+    int (*init)(void);
+    void *(*malloc)(size_t size); /* mm_malloc, or class/near_malloc (-k, -n) */
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    int (*malloc_batch)(size_t size, int n, void **ptrs);
+    void (*free_batch)(void **ptrs, int n);
+    void (*stats)(mm_stats_t *stats);
+    int (*seg_stats)(int cls, size_t *size, long *hits, long *misses);
+    void *(*malloc_class)(int cls);
+    void *(*plain_malloc)(size_t size); /* mm_malloc itself */
+    void *(*malloc_near)(size_t size, void *hint);
+    mm_region_t *(*region_create)(void); /* NULL if the package has none */
+    void *(*region_alloc)(mm_region_t *r, size_t size);
+    void (*region_destroy)(mm_region_t *r);
+    int (*checkheap)(int verbose);
+} backend_t;
+
 /********************
  * Global variables
  *******************/
@@ -92,6 +220,18 @@ int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc    */
 char msg[MAXLINE];      /* for whenever we need to compose an error message    */
 int debug = 0;          /* global flag for conditionally printing debug output */
+static int mt_reps = 3; /* best of this many multithreaded replays */
+static FILE *frag_file; /* fragmentation time series, if -F */
+static int frag_interval = FRAGINTERVAL; /* ops between its samples (-i) */
+static int region_check = 0; /* also allocate from regions in eval_mm_valid (-r) */
+
+/* The package the eval_mm routines run, the linked mm.o unless -b */
+static backend_t builtin = {"builtin", mm_init, mm_malloc, mm_free, mm_realloc,
+			    mm_malloc_batch, mm_free_batch, mm_stats,
+			    mm_seg_stats, mm_malloc_class, mm_malloc, mm_malloc_near,
+			    mm_region_create, mm_region_alloc,
+			    mm_region_destroy, mm_checkheap};
+static backend_t *backend = &builtin;
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
@@ -111,9 +251,18 @@ static int add_range(range_t **ranges, char *lo, int size,
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static range_t *range_alloc(void);
+static range_t *range_insert(range_t *t, range_t *p);
+static range_t *range_delete(range_t *t, char *lo);
+static range_t *range_rotate_left(range_t *t);
+static range_t *range_rotate_right(range_t *t);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static int map_trace(trace_t *trace, char *path);
+static void alloc_blocks(trace_t *trace);
+static void unbatch_trace(trace_t *trace);
+static int trace_calls(trace_t *trace);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -123,11 +272,76 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static int region_release(mm_region_t *r, char **blocks, int *sizes, int n,
+			  range_t **ranges, int tracenum, int opnum);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *rss);
+static void frag_sample(int tracenum, int opnum, size_t live);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_stats(trace_t *trace, mm_stats_t *stats);
+
+/* Times a xx_speed routine in each cache state (-C) */
+static void eval_cache_modes(fsecs_test_funct f, speed_t *params, 
+			     size_t bytes, double *secs);
+
+/* Checks correctness and utilization of many traces at once (-j) */
+static void eval_mm_parallel(char **tracefiles, int num_tracefiles, int jobs,
+			     int unbatch, size_t max_heap, int hugepages,
+			     stats_t *stats);
+
+/* Multithreaded replay of a trace against mm.c or libc malloc (-T) */
+static void eval_mt_speed(trace_t *trace, int nthreads, int partition,
+			  int use_mm, mtstats_t *stats);
+static void *mt_replay(void *ptr);
+
+/* Loads a package to run from a shared object (-b) */
+static void load_backend(char *path, backend_t *b);
+static int each_malloc_batch(size_t size, int n, void **ptrs);
+static void each_free_batch(void **ptrs, int n);
+static void no_stats(mm_stats_t *stats);
+static int no_seg_stats(int cls, size_t *size, long *hits, long *misses);
+static int no_checkheap(int verbose);
+static void *class_malloc(size_t size);
+static void *size_malloc_class(int cls);
+static void *near_malloc(size_t size);
+static void *hintless_malloc_near(size_t size, void *hint);
+
+/* Runs and compares several packages against the first (-b) */
+static int compare_backends(backend_t *backends, int nb, char **tracefiles,
+			    int num_tracefiles, int jobs, int unbatch, 
+			    size_t max_heap, int hugepages, int nthreads, 
+			    int partition, double regress_pct, FILE *json);
+static void eval_backend(trace_t *trace, int i, int jobs, int nthreads,
+			 int partition, stats_t *stats, mtstats_t *mtstats);
+static int compare_secs(stats_t *base, stats_t *stats, int n, 
+			double *speedup, double *t);
+static int regressed(stats_t *base, stats_t *stats, int n, int errs,
+		     double pct, char *why);
 
 /* Various helper routines */
+static double perf_index(double util, double throughput, double *p1, 
+			 double *p2);
 static void printresults(int n, stats_t *stats);
+static void printclasses(void);
+static void printstats(int n, mm_stats_t *stats);
+static void printevents(int n, stats_t *stats);
+static void printcache(int n, stats_t *stats, size_t bytes);
+#if LATENCY_HIST
+static void hist_add(hist_t *h, double cycles);
+static double hist_percentile(hist_t *h, double q);
+static void printlatency(int n, latstats_t (*stats)[3]);
+#endif
+static void printmtresults(int n, mtstats_t *stats, int nthreads, 
+			   int partition);
+static void printcompare(int nb, backend_t *backends, int n, stats_t **stats,
+			 int *errs);
+static void printmtcompare(int nb, int n, mtstats_t **stats, int nthreads,
+			   int partition);
+static void jsonstr(FILE *fp, char *s);
+static void writejson(FILE *fp, int nb, backend_t *backends, stats_t **stats,
+		      mtstats_t **mtstats, int n, char **tracefiles, int *errs,
+		      double regress_pct);
+static double wall_secs(void);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -147,10 +361,34 @@ int main(int argc, char **argv)
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
+    fsecs_stats_t timing;      /* spread of the xx_speed repetitions */
+    mtstats_t *mt_libc_stats = NULL; /* libc -T stats for each trace */
+    mtstats_t *mt_mm_stats = NULL;   /* mm -T stats for each trace */
+    mm_stats_t *internal_stats = NULL; /* mm_stats() for each trace */
+#if LATENCY_HIST
+    latstats_t (*lat_stats)[3] = NULL; /* mm latencies for each trace */
+    int op;
+#endif
 
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int nthreads = 0;    /* If set, also replay on this many threads (-T) */
+    int partition = 0;   /* If set, split the trace across the threads (-P) */
+    int run_stats = 0;   /* If set, print allocator-internal stats (-s) */
+    size_t max_heap = MAX_HEAP; /* Bytes of address space for the heap (-m) */
+    int hugepages = 0;   /* If set, back the heap with huge pages (-H) */
+    int unbatch = 0;     /* If set, replay batches one block at a time (-B) */
+    int jobs = 1;        /* Traces checked in parallel (-j) */
+    int count_events = 0;/* If set, count hardware events per op (-p) */
+    int cache_modes = 0; /* If set, time cold, warm and polluted runs (-C) */
+    size_t cache_bytes = 0; /* Cache flush buffer size, 0 for the LLC (-C) */
+    backend_t backends[MAXBACKENDS]; /* Packages to run (-b) */
+    int num_backends = 0;
+    FILE *json = NULL;   /* Machine-readable results, if -J */
+    double regress_pct = REGRESSPCT; /* Slowdown that fails a comparison (-R) */
+    int fixed_classes = 0; /* If set, allocate by size class (-k) */
+    int near_hints = 0;  /* If set, allocate near the previous block (-n) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -159,7 +397,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:d:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:d:T:m:j:c:C:F:i:b:J:R:hvVgalPpsHBkrn")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -185,6 +423,104 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'T': /* Replay each trace on this many threads at once */
+            if ((nthreads = atoi(optarg)) < 1) {
+		printf("mdriver: -T requires a positive thread count\n");
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'P': /* Partition each trace across the -T threads */
+            partition = 1;
+            break;
+        case 'p': /* Count hardware events in the speed runs */
+            count_events = 1;
+            break;
+        case 's': /* Print the allocator's internal statistics */
+            run_stats = 1;
+            break;
+        case 'm': /* Reserve this many MB of address space for the heap */
+            if (atol(optarg) < 1) {
+		printf("mdriver: -m requires a positive size in MB\n");
+		usage();
+		exit(1);
+	    }
+            max_heap = (size_t)atol(optarg) << 20;
+            break;
+        case 'H': /* Back the heap with transparent huge pages */
+            hugepages = 1;
+            break;
+        case 'B': /* Replay batch requests one block at a time */
+            unbatch = 1;
+            break;
+        case 'k': /* Allocate through mm_malloc_class where a class fits */
+            fixed_classes = 1;
+            break;
+        case 'n': /* Pass the previous block to mm_malloc_near as the hint */
+            near_hints = 1;
+            break;
+        case 'r': /* Check regions alongside the trace's own blocks */
+            region_check = 1;
+            break;
+        case 'c': /* Time the speed runs with this timer */
+            if (set_fsecs_timer(optarg) < 0) {
+		printf("mdriver: unknown timer %s\n", optarg);
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'C': /* Time cold, warm and polluted with a buffer of MB */
+            if (atol(optarg) < 0) {
+		printf("mdriver: -C requires a size in MB, or 0 for the LLC\n");
+		usage();
+		exit(1);
+	    }
+            cache_modes = 1;
+            cache_bytes = (size_t)atol(optarg) << 20;
+            break;
+        case 'j': /* Check this many traces in parallel */
+            if ((jobs = atoi(optarg)) < 1) {
+		printf("mdriver: -j requires a positive job count\n");
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'F': /* Write a fragmentation time series to this CSV file */
+            if ((frag_file = fopen(optarg, "w")) == NULL) {
+		printf("mdriver: could not open %s for -F\n", optarg);
+		exit(1);
+	    }
+	    fprintf(frag_file, "trace,op,live_bytes,heap_bytes,largest_free,"
+		    "free_blocks,free_bytes,internal_bytes,internal_frag,"
+		    "external_frag\n");
+            break;
+        case 'i': /* Sample fragmentation every this many ops */
+            if ((frag_interval = atoi(optarg)) < 1) {
+		printf("mdriver: -i requires a positive op count\n");
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'b': /* Run the package in this shared object, or "builtin" */
+            if (num_backends == MAXBACKENDS) {
+		printf("mdriver: at most %d packages with -b\n", MAXBACKENDS);
+		exit(1);
+	    }
+            load_backend(optarg, &backends[num_backends++]);
+            break;
+        case 'J': /* Write the results as JSON to this file */
+            if ((json = fopen(optarg, "w")) == NULL) {
+		printf("mdriver: could not open %s for -J\n", optarg);
+		exit(1);
+	    }
+            break;
+        case 'R': /* Fail a comparison on a slowdown of this many percent */
+            if ((regress_pct = atof(optarg)) < 0) {
+		printf("mdriver: -R requires a non-negative percentage\n");
+		usage();
+		exit(1);
+	    }
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -208,6 +544,28 @@ int main(int argc, char **argv)
         }
     }
 	
+    /* Route allocations the way mm_malloc_fixed compiles constant sizes */
+    if (fixed_classes && near_hints) {
+	printf("mdriver: -k and -n each replace mm_malloc, choose one\n");
+	usage();
+	exit(1);
+    }
+    if (fixed_classes) {
+	builtin.malloc = class_malloc;
+	for (i = 0; i < num_backends; i++)
+	    backends[i].malloc = class_malloc;
+    }
+    if (near_hints) {
+	builtin.malloc = near_malloc;
+	for (i = 0; i < num_backends; i++)
+	    backends[i].malloc = near_malloc;
+    }
+    if (region_check)
+	for (i = 0; i < num_backends; i++)
+	    if (backends[i].region_create == NULL)
+		printf("%s has no regions, checking it without -r.\n",
+		       backends[i].name);
+
     /* 
      * Check and print team info 
      */
@@ -246,6 +604,10 @@ int main(int argc, char **argv)
 
     /* Initialize the timing package */
     init_fsecs();
+    if (count_events && perf_open() == 0) {
+	printf("No hardware counters available, ignoring -p.\n");
+	count_events = 0;
+    }
 
     /*
      * Optionally run and evaluate the libc malloc package 
@@ -258,11 +620,16 @@ int main(int argc, char **argv)
 	libc_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
 	if (libc_stats == NULL)
 	    unix_error("libc_stats calloc in main failed");
+	mt_libc_stats = (mtstats_t *)calloc(num_tracefiles, sizeof(mtstats_t));
+	if (mt_libc_stats == NULL)
+	    unix_error("mt_libc_stats calloc in main failed");
 	
 	/* Evaluate the libc malloc package using the K-best scheme */
 	for (i=0; i < num_tracefiles; i++) {
 	    trace = read_trace(tracedir, tracefiles[i]);
-	    libc_stats[i].ops = trace->num_ops;
+	    if (unbatch)
+		unbatch_trace(trace);
+	    libc_stats[i].ops = trace_calls(trace);
 	    if (verbose > 1)
 		printf("Checking libc malloc for correctness, ");
 	    libc_stats[i].valid = eval_libc_valid(trace, i);
@@ -270,7 +637,19 @@ int main(int argc, char **argv)
 		speed_params.trace = trace;
 		if (verbose > 1)
 		    printf("and performance.\n");
-		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+		libc_stats[i].secs = fsecs_stats(eval_libc_speed, 
+						 &speed_params, &timing);
+		libc_stats[i].median = timing.median;
+		libc_stats[i].ci = timing.ci;
+		if (count_events)
+		    perf_count(eval_libc_speed, &speed_params, 
+			       libc_stats[i].events);
+		if (cache_modes)
+		    eval_cache_modes(eval_libc_speed, &speed_params, 
+				     cache_bytes, libc_stats[i].cache_secs);
+		if (nthreads)
+		    eval_mt_speed(trace, nthreads, partition, 0, 
+				  &mt_libc_stats[i]);
 	    }
 	    free_trace(trace);
 	}
@@ -280,7 +659,35 @@ int main(int argc, char **argv)
 	    printf("\nResults for libc malloc:\n");
 	    printresults(num_tracefiles, libc_stats);
 	}
+	if (count_events) {
+	    printf("\nHardware events per op for libc malloc:\n");
+	    printevents(num_tracefiles, libc_stats);
+	}
+	if (cache_modes) {
+	    printf("\nThroughput of libc malloc by cache state:\n");
+	    printcache(num_tracefiles, libc_stats, cache_bytes);
+	}
+	if (nthreads) {
+	    printf("\nResults for libc malloc on %d threads:\n", nthreads);
+	    printmtresults(num_tracefiles, mt_libc_stats, nthreads, partition);
+	}
+    }
+
+    /*
+     * With more than one -b, compare the packages side by side instead
+     */
+    if (num_backends > 1) {
+	if (count_events || cache_modes || run_stats || frag_file != NULL)
+	    printf("-p, -C, -s and -F measure a single package, ignoring them.\n");
+	frag_file = NULL;
+	mem_init_size(max_heap, hugepages);
+	exit(compare_backends(backends, num_backends, tracefiles, 
+			      num_tracefiles, jobs, unbatch, max_heap, 
+			      hugepages, nthreads, partition, regress_pct, 
+			      json));
     }
+    if (num_backends == 1)
+	backend = &backends[0];
 
     /*
      * Always run and evaluate the student's mm package
@@ -292,29 +699,91 @@ int main(int argc, char **argv)
     mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
+    mt_mm_stats = (mtstats_t *)calloc(num_tracefiles, sizeof(mtstats_t));
+    if (mt_mm_stats == NULL)
+	unix_error("mt_mm_stats calloc in main failed");
+    internal_stats = (mm_stats_t *)calloc(num_tracefiles, sizeof(mm_stats_t));
+    if (internal_stats == NULL)
+	unix_error("internal_stats calloc in main failed");
+#if LATENCY_HIST
+    lat_stats = calloc(num_tracefiles, sizeof(*lat_stats));
+    if (lat_stats == NULL)
+	unix_error("lat_stats calloc in main failed");
+#endif
     
+    /* Workers would interleave their samples in the one file */
+    if (frag_file != NULL && jobs > 1) {
+	printf("-F samples from a single process, ignoring -j.\n");
+	jobs = 1;
+    }
+
+    /* 
+     * With -j, check correctness and utilization of all the traces
+     * first, in parallel, and leave only the timing runs to the loop
+     * below so that they never compete with each other for the CPU
+     */
+    if (jobs > 1)
+	eval_mm_parallel(tracefiles, num_tracefiles, jobs, unbatch,
+			 max_heap, hugepages, mm_stats);
+
     /* Initialize the simulated memory system in memlib.c */
-    mem_init(); 
+    mem_init_size(max_heap, hugepages); 
 
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
+	if (jobs > 1 && (debug || !mm_stats[i].valid))
+	    continue;
 	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+	if (unbatch)
+	    unbatch_trace(trace);
+	mm_stats[i].ops = trace_calls(trace);
+	if (jobs == 1) {
+	    if (verbose > 1)
+		printf("Checking mm_malloc for correctness, ");
+	    mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+	}
 	if ( !debug ) {
 	  if (mm_stats[i].valid) {
-	    if (verbose > 1)
-	      printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    if (jobs == 1) {
+	      if (verbose > 1)
+		printf("efficiency, ");
+	      mm_stats[i].util = eval_mm_util(trace, i, &ranges,
+					       &mm_stats[i].rss);
+	    }
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
 	      printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+#if LATENCY_HIST
+	    memset(lat_hist, 0, sizeof(lat_hist));
+#endif
+	    mm_stats[i].secs = fsecs_stats(eval_mm_speed, &speed_params,
+					   &timing);
+	    mm_stats[i].median = timing.median;
+	    mm_stats[i].ci = timing.ci;
+	    mm_stats[i].reps = timing.reps;
+	    if (count_events)
+		perf_count(eval_mm_speed, &speed_params, mm_stats[i].events);
+	    if (cache_modes)
+		eval_cache_modes(eval_mm_speed, &speed_params, cache_bytes,
+				 mm_stats[i].cache_secs);
+#if LATENCY_HIST
+	    for (op = 0; op < 3; op++) {
+		lat_stats[i][op].calls = lat_hist[op].n;
+		lat_stats[i][op].p50 = hist_percentile(&lat_hist[op], 0.5);
+		lat_stats[i][op].p99 = hist_percentile(&lat_hist[op], 0.99);
+		lat_stats[i][op].p999 = hist_percentile(&lat_hist[op], 0.999);
+		lat_stats[i][op].max = lat_hist[op].max;
+	    }
+#endif
+	    if (nthreads)
+		eval_mt_speed(trace, nthreads, partition, 1, &mt_mm_stats[i]);
+	    if (run_stats)
+		eval_mm_stats(trace, &internal_stats[i]);
 	  }
 	}
+	if (verbose > 1)
+	    printclasses();
 	free_trace(trace);
     }
 
@@ -324,6 +793,33 @@ int main(int argc, char **argv)
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
     }
+    if (count_events && !debug) {
+	printf("Hardware events per op for mm malloc:\n");
+	printevents(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+    if (cache_modes && !debug) {
+	printf("Throughput of mm malloc by cache state:\n");
+	printcache(num_tracefiles, mm_stats, cache_bytes);
+	printf("\n");
+    }
+    if (run_stats && !debug) {
+	printf("Internal statistics for mm malloc:\n");
+	printstats(num_tracefiles, internal_stats);
+	printf("\n");
+    }
+#if LATENCY_HIST
+    if (!debug) {
+	printf("Latency of mm calls in cycles:\n");
+	printlatency(num_tracefiles, lat_stats);
+	printf("\n");
+    }
+#endif
+    if (nthreads && !debug) {
+	printf("Results for mm malloc on %d threads:\n", nthreads);
+	printmtresults(num_tracefiles, mt_mm_stats, nthreads, partition);
+	printf("\n");
+    }
 
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
@@ -346,17 +842,7 @@ int main(int argc, char **argv)
      */
     if (errors == 0  && !debug) {
 	avg_mm_throughput = ops/secs;
-
-	p1 = UTIL_WEIGHT * avg_mm_util;
-	if (avg_mm_throughput > AVG_LIBC_THRUPUT) {
-	    p2 = (double)(1.0 - UTIL_WEIGHT);
-	} 
-	else {
-	    p2 = ((double) (1.0 - UTIL_WEIGHT)) * 
-		(avg_mm_throughput/AVG_LIBC_THRUPUT);
-	}
-	
-	perfindex = (p1 + p2)*100.0;
+	perfindex = perf_index(avg_mm_util, avg_mm_throughput, &p1, &p2);
 	printf("Perf index = %.0f (util) + %.0f (thru) = %.0f/100\n",
 	       p1*100, 
 	       p2*100, 
@@ -372,28 +858,38 @@ int main(int argc, char **argv)
 	printf("correct:%d\n", numcorrect);
 	printf("perfidx:%.0f\n", perfindex);
     }
+    if (json != NULL && !debug) {
+	writejson(json, 1, backend, &mm_stats, nthreads ? &mt_mm_stats : NULL,
+		  num_tracefiles, tracefiles, &errors, regress_pct);
+	fclose(json);
+    }
 
     exit(0);
 }
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range index, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range index to detect any overlapping allocated blocks. Every
+ * operation takes O(log n) expected time, and the records come from a
+ * pool instead of one malloc each.
  ****************************************************************/
 
+static range_t *range_pool = NULL;  /* free range records */
+static unsigned range_seed = 1;     /* xorshift state for priorities */
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range index. 
  */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *floor;
     char msg[MAXLINE];
 
     assert(size > 0);
@@ -406,36 +902,44 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap or a mapping */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_is_mapped(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    /* 
+     * The payload must not overlap any other payloads. The indexed
+     * payloads are disjoint, so only the one starting last at or
+     * before hi can overlap.
+     */
+    for (p = *ranges, floor = NULL;  p != NULL; ) {
+	if (p->lo <= hi) {
+	    floor = p;
+	    p = p->right;
+	}
+	else
+	    p = p->left;
+    }
+    if (floor != NULL && floor->hi >= lo) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, floor->lo, floor->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range index.
      */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-	unix_error("malloc error in add_range");
-    p->next = *ranges;
+    p = range_alloc();
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    *ranges = range_insert(*ranges, p);
     return 1;
 }
 
@@ -444,34 +948,137 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-    int size;
+    *ranges = range_delete(*ranges, lo);
+}
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+/*
+ * clear_ranges - give all of the range records for a trace back to
+ *     the pool
+ */
+static void clear_ranges(range_t **ranges)
+{
+    range_t *p = *ranges;
+
+    /* Flatten the tree onto the pool by rotating left children up */
+    while (p != NULL) {
+	if (p->left != NULL)
+	    p = range_rotate_right(p);
+	else {
+	    range_t *next = p->right;
+
+	    p->left = range_pool;
+	    range_pool = p;
+	    p = next;
+	}
     }
+    *ranges = NULL;
 }
 
 /*
- * clear_ranges - free all of the range records for a trace 
+ * range_alloc - Take a record from the pool, refilling it with
+ *     RANGEPOOL records at a time, and give it a random priority
  */
-static void clear_ranges(range_t **ranges)
+static range_t *range_alloc(void)
 {
     range_t *p;
-    range_t *pnext;
+    int i;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    if (range_pool == NULL) {
+	if ((p = (range_t *)malloc(RANGEPOOL * sizeof(range_t))) == NULL)
+	    unix_error("malloc error in range_alloc");
+	for (i = 0; i < RANGEPOOL; i++) {
+	    p[i].left = range_pool;
+	    range_pool = &p[i];
+	}
     }
-    *ranges = NULL;
+
+    p = range_pool;
+    range_pool = p->left;
+
+    range_seed ^= range_seed << 13;
+    range_seed ^= range_seed >> 17;
+    range_seed ^= range_seed << 5;
+    p->prio = range_seed;
+    p->left = p->right = NULL;
+    return p;
+}
+
+/*
+ * range_insert - Insert record p into treap t and return the new root
+ */
+static range_t *range_insert(range_t *t, range_t *p)
+{
+    if (t == NULL)
+	return p;
+
+    if (p->lo < t->lo) {
+	t->left = range_insert(t->left, p);
+	if (t->left->prio > t->prio)
+	    t = range_rotate_right(t);
+    }
+    else {
+	t->right = range_insert(t->right, p);
+	if (t->right->prio > t->prio)
+	    t = range_rotate_left(t);
+    }
+    return t;
+}
+
+/*
+ * range_delete - Remove the record starting at lo, if any, from treap
+ *     t, give it back to the pool, and return the new root
+ */
+static range_t *range_delete(range_t *t, char *lo)
+{
+    range_t *child;
+
+    if (t == NULL)
+	return NULL;
+
+    if (lo < t->lo)
+	t->left = range_delete(t->left, lo);
+    else if (lo > t->lo)
+	t->right = range_delete(t->right, lo);
+    else if (t->left == NULL || t->right == NULL) {
+	child = (t->left != NULL) ? t->left : t->right;
+	t->left = range_pool;
+	range_pool = t;
+	return child;
+    }
+    else if (t->left->prio > t->right->prio) {
+	/* Rotate the record down below its higher priority child */
+	t = range_rotate_right(t);
+	t->right = range_delete(t->right, lo);
+    }
+    else {
+	t = range_rotate_left(t);
+	t->left = range_delete(t->left, lo);
+    }
+    return t;
+}
+
+/*
+ * range_rotate_left - Lift the right child of t into its place
+ */
+static range_t *range_rotate_left(range_t *t)
+{
+    range_t *r = t->right;
+
+    t->right = r->left;
+    r->left = t;
+    return r;
+}
+
+/*
+ * range_rotate_right - Lift the left child of t into its place
+ */
+static range_t *range_rotate_right(range_t *t)
+{
+    range_t *l = t->left;
+
+    t->left = l->right;
+    l->right = t;
+    return l;
 }
 
 
@@ -488,9 +1095,10 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index, size, count;
     unsigned max_index = 0;
     unsigned op_index;
+    int batched = 0;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
@@ -499,9 +1107,17 @@ static trace_t *read_trace(char *tracedir, char *filename)
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
 	unix_error("malloc 1 failed in read_trance");
 	
-    /* Read the trace file header */
+    /* A binary trace needs no parsing at all */
     strcpy(path, tracedir);
     strcat(path, filename);
+    trace->map = NULL;
+    trace->threaded = 0;
+    if (map_trace(trace, path)) {
+	alloc_blocks(trace);
+	return trace;
+    }
+
+    /* Read the trace file header */
     if ((tracefile = fopen(path, "r")) == NULL) {
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
@@ -516,15 +1132,8 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
 	unix_error("malloc 2 failed in read_trace");
 
-    /* We'll keep an array of pointers to the allocated blocks here... */
-    if ((trace->blocks = 
-	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
-	unix_error("malloc 3 failed in read_trace");
-
-    /* ... along with the corresponding byte sizes of each block */
-    if ((trace->block_sizes = 
-	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
-	unix_error("malloc 4 failed in read_trace");
+ 
+    alloc_blocks(trace);
     
     /* read every request line in the trace file */
     index = 0;
@@ -536,6 +1145,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].type = ALLOC;
 	    trace->ops[op_index].index = index;
 	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].count = 1;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
 	case 'r':
@@ -543,22 +1153,52 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].type = REALLOC;
 	    trace->ops[op_index].index = index;
 	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].count = 1;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
 	case 'f':
 	    fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
 	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].count = 1;
+	    break;
+	case 'A':
+	    fscanf(tracefile, "%u %u %u", &index, &count, &size);
+	    trace->ops[op_index].type = ALLOC_BATCH;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].count = count;
+	    max_index = (index + count - 1 > max_index) ? 
+		index + count - 1 : max_index;
+	    break;
+	case 'F':
+	    fscanf(tracefile, "%u %u", &index, &count);
+	    trace->ops[op_index].type = FREE_BATCH;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].count = count;
 	    break;
 	default:
 	    printf("Bogus type character (%c) in tracefile %s\n", 
 		   type[0], path);
 	    exit(1);
 	}
+
+	/* "x:tid" names the thread that issues the request */
+	trace->ops[op_index].tid = -1;
+	if (type[1] == ':') {
+	    trace->ops[op_index].tid = atoi(type + 2);
+	    trace->threaded = 1;
+	}
+	if (type[0] == 'A' || type[0] == 'F')
+	    batched = 1;
 	op_index++;
 	
     }
     fclose(tracefile);
+    if (trace->threaded && batched) {
+	printf("Thread tags and batch requests mixed in tracefile %s\n", path);
+	exit(1);
+    }
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
     
@@ -571,12 +1211,128 @@ static trace_t *read_trace(char *tracedir, char *filename)
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
-    free(trace->blocks);      
-    free(trace->block_sizes);
+    if (trace->map != NULL)   /* unmap or free the requests... */
+	munmap(trace->map, trace->map_size);
+    else
+	free(trace->ops);
+    free(trace->blocks);      /* ... the block arrays... */
     free(trace);              /* and the trace record itself... */
 }
 
+/*
+ * map_trace - If path is a binary trace, mmap it and point trace's
+ *     header fields and ops array into the mapping. Returns 0 if path
+ *     is not a binary trace.
+ */
+static int map_trace(trace_t *trace, char *path)
+{
+    bintrace_hdr_t *hdr;
+    struct stat st;
+    void *map;
+    int fd, i;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+	sprintf(msg, "Could not open %s in read_trace", path);
+	unix_error(msg);
+    }
+    if (fstat(fd, &st) < 0)
+	unix_error("fstat failed in map_trace");
+    if (st.st_size < sizeof(bintrace_hdr_t)) {
+	close(fd);
+	return 0;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+	unix_error("mmap failed in map_trace");
+
+    hdr = (bintrace_hdr_t *)map;
+    if (hdr->magic != BINTRACE_MAGIC) {
+	munmap(map, st.st_size);
+	return 0;
+    }
+    if (hdr->version != BINTRACE_VERSION || hdr->num_ops < 0 ||
+	st.st_size != sizeof(bintrace_hdr_t) + 
+	(size_t)hdr->num_ops * sizeof(traceop_t)) {
+	printf("Bad binary trace header in %s\n", path);
+	exit(1);
+    }
+
+    trace->sugg_heapsize = hdr->sugg_heapsize;
+    trace->num_ids = hdr->num_ids;
+    trace->num_ops = hdr->num_ops;
+    trace->weight = hdr->weight;
+    trace->ops = (traceop_t *)(hdr + 1);
+    trace->map = map;
+    trace->map_size = st.st_size;
+    for (i = 0; i < trace->num_ops && !trace->threaded; i++)
+	trace->threaded = (trace->ops[i].tid >= 0);
+    return 1;
+}
+
+/*
+ * alloc_blocks - Allocate the block pointer and block size arrays of a
+ *     trace together in one chunk
+ */
+static void alloc_blocks(trace_t *trace)
+{
+    /* We'll keep an array of pointers to the allocated blocks here... */
+    if ((trace->blocks = (char **)malloc(trace->num_ids * 
+	 (sizeof(char *) + sizeof(size_t)))) == NULL)
+	unix_error("malloc failed in alloc_blocks");
+
+    /* ... along with the corresponding byte sizes of each block */
+    trace->block_sizes = (size_t *)(trace->blocks + trace->num_ids);
+}
+
+/*
+ * unbatch_trace - Replace each batch request of a trace by the single
+ *     block requests it stands for, so the two paths can be compared
+ */
+static void unbatch_trace(trace_t *trace)
+{
+    traceop_t *ops;
+    int i, j, n;
+
+    n = trace_calls(trace);
+    if ((ops = (traceop_t *)malloc(n * sizeof(traceop_t))) == NULL)
+	unix_error("malloc failed in unbatch_trace");
+
+    for (i = 0, n = 0; i < trace->num_ops; i++) {
+	for (j = 0; j < trace->ops[i].count; j++, n++) {
+	    ops[n] = trace->ops[i];
+	    ops[n].index += j;
+	    ops[n].count = 1;
+	    if (ops[n].type == ALLOC_BATCH)
+		ops[n].type = ALLOC;
+	    else if (ops[n].type == FREE_BATCH)
+		ops[n].type = FREE;
+	}
+    }
+
+    if (trace->map != NULL)
+	munmap(trace->map, trace->map_size);
+    else
+	free(trace->ops);
+    trace->map = NULL;
+    trace->ops = ops;
+    trace->num_ops = n;
+}
+
+/*
+ * trace_calls - Return the number of blocks a trace's requests act on,
+ *     which is its number of requests if it has no batches
+ */
+static int trace_calls(trace_t *trace)
+{
+    int i, n = 0;
+
+    for (i = 0; i < trace->num_ops; i++)
+	n += trace->ops[i].count;
+    return n;
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
@@ -590,17 +1346,22 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     int i, j;
     int index;
     int size;
+    int count;
     int oldsize;
     char *newp;
     char *oldp;
     char *p;
+    mm_region_t *r = NULL;          /* region of -r, if any */
+    char *rblocks[REGIONSPAN];      /* its blocks, */
+    int rsizes[REGIONSPAN];         /* their sizes, */
+    int nr = 0;                     /* and how many there are */
     
     /* Reset the heap and free any records in the range list */
     mem_reset_brk();
     clear_ranges(ranges);
 
     /* Call the mm package's init function */
-    if (mm_init() < 0) {
+    if (backend->init() < 0) {
 	malloc_error(tracenum, 0, "mm_init failed.");
 	return 0;
     }
@@ -609,13 +1370,30 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     for (i = 0;  i < trace->num_ops;  i++) {
 	index = trace->ops[i].index;
 	size = trace->ops[i].size;
+	count = trace->ops[i].count;
+
+	/* 
+	 * With -r, a region lives alongside the trace's blocks for
+	 * REGIONSPAN requests, then dies and the heap must still check
+	 */
+	if (region_check && backend->region_create != NULL &&
+	    i % REGIONSPAN == 0) {
+	    if (r != NULL && 
+		region_release(r, rblocks, rsizes, nr, ranges, tracenum, i) == 0)
+		return 0;
+	    nr = 0;
+	    if ((r = backend->region_create()) == NULL) {
+		malloc_error(tracenum, i, "mm_region_create failed.");
+		return 0;
+	    }
+	}
 
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
 
 	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
+	    if ((p = backend->malloc(size)) == NULL) {
 		malloc_error(tracenum, i, "mm_malloc failed.");
 		return 0;
 	    }
@@ -638,13 +1416,26 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    /* Remember region */
 	    trace->blocks[index] = p;
 	    trace->block_sizes[index] = size;
+
+	    /* A region block of the same size, checked the same way */
+	    if (r != NULL) {
+		if ((p = backend->region_alloc(r, size)) == NULL) {
+		    malloc_error(tracenum, i, "mm_region_alloc failed.");
+		    return 0;
+		}
+		if (add_range(ranges, p, size, tracenum, i) == 0)
+		    return 0;
+		memset(p, nr & 0xFF, size);
+		rblocks[nr] = p;
+		rsizes[nr++] = size;
+	    }
 	    break;
 
         case REALLOC: /* mm_realloc */
 	    
 	    /* Call the student's realloc */
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_realloc(oldp, size)) == NULL) {
+	    if ((newp = backend->realloc(oldp, size)) == NULL) {
 		malloc_error(tracenum, i, "mm_realloc failed.");
 		return 0;
 	    }
@@ -664,7 +1455,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -682,7 +1473,30 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    /* Remove region from list and call student's free function */
 	    p = trace->blocks[index];
 	    remove_range(ranges, p);
-	    mm_free(p);
+	    backend->free(p);
+	    break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+
+	    /* Every block of the batch is checked like a single malloc */
+	    if (backend->malloc_batch(size, count, 
+				(void **)&trace->blocks[index]) != count) {
+		malloc_error(tracenum, i, "mm_malloc_batch failed.");
+		return 0;
+	    }
+	    for (j = 0; j < count; j++) {
+		p = trace->blocks[index + j];
+		if (add_range(ranges, p, size, tracenum, i) == 0)
+		    return 0;
+		memset(p, (index + j) & 0xFF, size);
+		trace->block_sizes[index + j] = size;
+	    }
+	    break;
+
+        case FREE_BATCH: /* mm_free_batch */
+	    for (j = 0; j < count; j++)
+		remove_range(ranges, trace->blocks[index + j]);
+	    backend->free_batch((void **)&trace->blocks[index], count);
 	    break;
 
 	default:
@@ -691,34 +1505,81 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 
     }
 
+    /* The last region dies with the trace's blocks still live */
+    if (r != NULL &&
+	region_release(r, rblocks, rsizes, nr, ranges, tracenum, i) == 0)
+	return 0;
+
     /* As far as we know, this is a valid malloc package */
     return 1;
 }
 
+/*
+ * region_release - Check that the n blocks of region r still hold what
+ *     eval_mm_valid wrote, destroy r, and check the heap it leaves
+ */
+static int region_release(mm_region_t *r, char **blocks, int *sizes, int n,
+			  range_t **ranges, int tracenum, int opnum)
+{
+    int i, j, errs;
+
+    for (i = 0; i < n; i++) {
+	for (j = 0; j < sizes[i]; j++) {
+	    if ((unsigned char)blocks[i][j] != (i & 0xFF)) {
+		malloc_error(tracenum, opnum, "mm_region_alloc block was "
+			     "overwritten before mm_region_destroy");
+		return 0;
+	    }
+	}
+	remove_range(ranges, blocks[i]);
+    }
+    backend->region_destroy(r);
+
+    if ((errs = backend->checkheap(0)) != 0) {
+	sprintf(msg, "mm_checkheap found %d errors after mm_region_destroy", 
+		errs);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
+    }
+    return 1;
+}
+
 /* 
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   largest size the heap reached while running the student's malloc 
+ *   package on the trace. The package may shrink the heap, so brk is
+ *   sampled after every request, and regions it mapped outside the
+ *   heap count as heap. The peak number of resident heap bytes is
+ *   returned in *rss, counting mapped regions as fully resident. It is
+ *   sampled at most RSSSAMPLES times, since each sample costs a mincore
+ *   call over the whole heap. With -F, the fragmentation of the heap is
+ *   written out every frag_interval requests as well.
  *   
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *rss)
 {   
-    int i;
-    int index;
+    int i, j;
+    int index, count;
     int size, newsize, oldsize;
     int max_total_size = 0;
     int total_size = 0;
+    size_t heap_size;
+    size_t max_heap_size = 0;
+    size_t max_resident = 0;
+    int rss_interval = (trace->num_ops + RSSSAMPLES - 1) / RSSSAMPLES;
     char *p;
     char *newp, *oldp;
 
+    /* Start from an empty heap with no resident pages */
+    mem_sbrk(-(int)mem_heapsize());
+
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
-    if (mm_init() < 0)
+    if (backend->init() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
     for (i = 0;  i < trace->num_ops;  i++) {
@@ -728,7 +1589,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
+	    if ((p = backend->malloc(size)) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
@@ -750,7 +1611,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_realloc(oldp,newsize)) == NULL)
+	    if ((newp = backend->realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc failed in eval_mm_util");
 
 	    /* Remember region and size */
@@ -771,7 +1632,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
-	    mm_free(p);
+	    backend->free(p);
 	    
 	    /* Keep track of current total size
 	     * of all allocated blocks */
@@ -779,15 +1640,76 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    break;
 
+	case ALLOC_BATCH: /* mm_malloc_batch */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    count = trace->ops[i].count;
+
+	    if (backend->malloc_batch(size, count, 
+				(void **)&trace->blocks[index]) != count)
+		app_error("mm_malloc_batch failed in eval_mm_util");
+	    for (j = 0; j < count; j++)
+		trace->block_sizes[index + j] = size;
+
+	    total_size += size * count;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
+	case FREE_BATCH: /* mm_free_batch */
+	    index = trace->ops[i].index;
+	    count = trace->ops[i].count;
+
+	    for (j = 0; j < count; j++)
+		total_size -= trace->block_sizes[index + j];
+	    backend->free_batch((void **)&trace->blocks[index], count);
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
+
+	heap_size = mem_heapsize() + mem_mapped_bytes();
+	max_heap_size = (heap_size > max_heap_size) ?
+	    heap_size : max_heap_size;
+	if (frag_file != NULL && 
+	    (i % frag_interval == 0 || i == trace->num_ops - 1))
+	    frag_sample(tracenum, i, total_size);
+	if (i % rss_interval == 0 || i == trace->num_ops - 1) {
+	    heap_size = mem_resident() + mem_mapped_bytes();
+	    max_resident = (heap_size > max_resident) ?
+		heap_size : max_resident;
+	}
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    *rss = (double)max_resident;
+    return ((double)max_total_size / (double)max_heap_size);
 }
 
+/*
+ * frag_sample - Write one line of the -F time series for request opnum
+ *     of trace tracenum, with live payload bytes allocated. Whatever
+ *     the heap holds beyond the live payload and the free blocks is
+ *     internal fragmentation: headers, alignment, rounding and cached
+ *     blocks. External fragmentation is the share of free memory that
+ *     the largest free block cannot serve.
+ */
+static void frag_sample(int tracenum, int opnum, size_t live)
+{
+    mm_stats_t stats;
+    size_t heap = mem_heapsize() + mem_mapped_bytes();
+    size_t internal;
+
+    backend->stats(&stats);
+    internal = heap - stats.free_bytes - live;
+    fprintf(frag_file, "%d,%d,%zu,%zu,%zu,%ld,%zu,%zu,%.4f,%.4f\n",
+	    tracenum, opnum, live, heap, stats.free_largest, 
+	    stats.free_blocks, stats.free_bytes, internal,
+	    heap ? (double)internal / heap : 0.0,
+	    stats.free_bytes ? 
+	    1.0 - (double)stats.free_largest / stats.free_bytes : 0.0);
+}
 
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
@@ -795,13 +1717,13 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size, newsize;
+    int i, index, size, newsize, count, n;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     /* Reset the heap and initialize the mm package */
     mem_reset_brk();
-    if (mm_init() < 0) 
+    if (backend->init() < 0) 
 	app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
@@ -811,7 +1733,8 @@ static void eval_mm_speed(void *ptr)
         case ALLOC: /* mm_malloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+            TIMED(ALLOC, p = backend->malloc(size));
+            if (p == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
@@ -820,7 +1743,8 @@ static void eval_mm_speed(void *ptr)
 	    index = trace->ops[i].index;
             newsize = trace->ops[i].size;
 	    oldp = trace->blocks[index];
-            if ((newp = mm_realloc(oldp,newsize)) == NULL)
+            TIMED(REALLOC, newp = backend->realloc(oldp,newsize));
+            if (newp == NULL)
 		app_error("mm_realloc error in eval_mm_speed");
             trace->blocks[index] = newp;
             break;
@@ -828,7 +1752,23 @@ static void eval_mm_speed(void *ptr)
         case FREE: /* mm_free */
             index = trace->ops[i].index;
             block = trace->blocks[index];
-            mm_free(block);
+            TIMED(FREE, backend->free(block));
+            break;
+
+	case ALLOC_BATCH: /* mm_malloc_batch */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            count = trace->ops[i].count;
+            TIMED(ALLOC, n = backend->malloc_batch(size, count, 
+					     (void **)&trace->blocks[index]));
+            if (n != count)
+		app_error("mm_malloc_batch error in eval_mm_speed");
+            break;
+
+	case FREE_BATCH: /* mm_free_batch */
+            index = trace->ops[i].index;
+            count = trace->ops[i].count;
+            TIMED(FREE, backend->free_batch((void **)&trace->blocks[index], count));
             break;
 
 	default:
@@ -844,7 +1784,7 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace, int tracenum)
 {
-    int i, newsize;
+    int i, j, newsize;
     char *p, *newp, *oldp;
 
     for (i = 0;  i < trace->num_ops;  i++) {
@@ -872,6 +1812,21 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 	    free(trace->blocks[trace->ops[i].index]);
 	    break;
 
+        case ALLOC_BATCH: /* one malloc per block */
+	    for (j = 0; j < trace->ops[i].count; j++) {
+		if ((p = malloc(trace->ops[i].size)) == NULL) {
+		    malloc_error(tracenum, i, "libc malloc failed");
+		    unix_error("System message");
+		}
+		trace->blocks[trace->ops[i].index + j] = p;
+	    }
+	    break;
+
+        case FREE_BATCH: /* one free per block */
+	    for (j = 0; j < trace->ops[i].count; j++)
+		free(trace->blocks[trace->ops[i].index + j]);
+	    break;
+
 	default:
 	    app_error("invalid operation type  in eval_libc_valid");
 	}
@@ -887,7 +1842,7 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
+    int i, j;
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
@@ -917,14 +1872,799 @@ static void eval_libc_speed(void *ptr)
 	    block = trace->blocks[index];
 	    free(block);
 	    break;
+
+        case ALLOC_BATCH: /* one malloc per block */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    for (j = 0; j < trace->ops[i].count; j++)
+		if ((trace->blocks[index + j] = malloc(size)) == NULL)
+		    unix_error("malloc failed in eval_libc_speed");
+	    break;
+
+        case FREE_BATCH: /* one free per block */
+	    index = trace->ops[i].index;
+	    for (j = 0; j < trace->ops[i].count; j++)
+		free(trace->blocks[index + j]);
+	    break;
+	}
+    }
+}
+
+/*
+ * eval_mm_stats - Replay a trace once and collect mm_stats: the event
+ *    counters of the whole replay, and the free blocks at the point
+ *    where the live payload peaks
+ */
+static void eval_mm_stats(trace_t *trace, mm_stats_t *stats)
+{
+    int i, j, index, size, count;
+    int peak = 0, total_size = 0, max_total_size = 0;
+    mm_stats_t at_peak;
+    char *p;
+
+    /* Find the request after which the live payload is largest */
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+	count = trace->ops[i].count;
+	switch (trace->ops[i].type) {
+	case ALLOC:
+	    total_size += size;
+	    trace->block_sizes[index] = size;
+	    break;
+	case REALLOC:
+	    total_size += size - trace->block_sizes[index];
+	    trace->block_sizes[index] = size;
+	    break;
+	case FREE:
+	    total_size -= trace->block_sizes[index];
+	    break;
+	case ALLOC_BATCH:
+	    total_size += size * count;
+	    for (j = 0; j < count; j++)
+		trace->block_sizes[index + j] = size;
+	    break;
+	case FREE_BATCH:
+	    for (j = 0; j < count; j++)
+		total_size -= trace->block_sizes[index + j];
+	    break;
+	}
+	if (total_size > max_total_size) {
+	    max_total_size = total_size;
+	    peak = i;
+	}
+    }
+
+    mem_reset_brk();
+    if (backend->init() < 0)
+	app_error("mm_init failed in eval_mm_stats");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+	count = trace->ops[i].count;
+	switch (trace->ops[i].type) {
+	case ALLOC:
+	    if ((p = backend->malloc(size)) == NULL)
+		app_error("mm_malloc failed in eval_mm_stats");
+	    trace->blocks[index] = p;
+	    break;
+	case ALLOC_BATCH:
+	    if (backend->malloc_batch(size, count, 
+				(void **)&trace->blocks[index]) != count)
+		app_error("mm_malloc_batch failed in eval_mm_stats");
+	    break;
+	case FREE_BATCH:
+	    backend->free_batch((void **)&trace->blocks[index], count);
+	    break;
+	case REALLOC:
+	    if ((p = backend->realloc(trace->blocks[index], size)) == NULL)
+		app_error("mm_realloc failed in eval_mm_stats");
+	    trace->blocks[index] = p;
+	    break;
+	case FREE:
+	    backend->free(trace->blocks[index]);
+	    break;
+	}
+	if (i == peak)
+	    backend->stats(&at_peak);
+    }
+
+    /* Counters from the end of the replay, free blocks from the peak */
+    backend->stats(stats);
+    stats->tree_depth = at_peak.tree_depth;
+    stats->free_blocks = at_peak.free_blocks;
+    stats->free_bytes = at_peak.free_bytes;
+    stats->free_largest = at_peak.free_largest;
+    memcpy(stats->free_bins, at_peak.free_bins, sizeof(stats->free_bins));
+}
+
+/*
+ * eval_mm_parallel - Run eval_mm_valid and eval_mm_util for every trace,
+ *     keeping up to jobs forked workers busy at a time. A worker that
+ *     dies before reporting (e.g. on a segfault in mm.c) fails its trace
+ *     without taking the driver down.
+ */
+static void eval_mm_parallel(char **tracefiles, int num_tracefiles, int jobs,
+			     int unbatch, size_t max_heap, int hugepages,
+			     stats_t *stats)
+{
+    pid_t *pids;       /* worker for each trace */
+    int *fds;          /* read end of each worker's result pipe */
+    int next = 0;      /* next trace to hand out */
+    int running = 0;   /* workers not yet reaped */
+    int i, j, fd[2], status;
+    pid_t pid;
+    trace_t *trace;
+    range_t *ranges = NULL;
+    jobresult_t res;
+
+    if ((pids = calloc(num_tracefiles, sizeof(pid_t))) == NULL ||
+	(fds = calloc(num_tracefiles, sizeof(int))) == NULL)
+	unix_error("calloc failed in eval_mm_parallel");
+
+    while (next < num_tracefiles || running > 0) {
+	/* Start workers until jobs of them are running */
+	while (running < jobs && next < num_tracefiles) {
+	    if (pipe(fd) < 0)
+		unix_error("pipe failed in eval_mm_parallel");
+	    fflush(stdout);
+	    if ((pid = fork()) < 0)
+		unix_error("fork failed in eval_mm_parallel");
+	    if (pid == 0) {
+		/* Worker: check one trace against a fresh heap */
+		close(fd[0]);
+		for (j = 0; j < next; j++)
+		    if (fds[j] >= 0)
+			close(fds[j]);
+		mem_init_size(max_heap, hugepages);
+		trace = read_trace(tracedir, tracefiles[next]);
+		if (unbatch)
+		    unbatch_trace(trace);
+		memset(&res, 0, sizeof(res));
+		res.valid = eval_mm_valid(trace, next, &ranges);
+		if (res.valid && !debug)
+		    res.util = eval_mm_util(trace, next, &ranges, &res.rss);
+		res.errors = errors;
+		fflush(stdout);
+		if (write(fd[1], &res, sizeof(res)) != sizeof(res))
+		    unix_error("write failed in eval_mm_parallel");
+		_exit(0);
+	    }
+	    close(fd[1]);
+	    pids[next] = pid;
+	    fds[next] = fd[0];
+	    next++;
+	    running++;
+	}
+
+	/* Collect whichever worker finishes first */
+	if ((pid = wait(&status)) < 0)
+	    unix_error("wait failed in eval_mm_parallel");
+	for (i = 0; i < next && pids[i] != pid; i++)
+	    ;
+	if (i == next)
+	    continue;
+	running--;
+	if (read(fds[i], &res, sizeof(res)) != sizeof(res)) {
+	    memset(&res, 0, sizeof(res));
+	    res.errors = 1;
+	    if (WIFSIGNALED(status))
+		printf("ERROR [trace %d]: worker killed by signal %d\n",
+		       i, WTERMSIG(status));
+	    else
+		printf("ERROR [trace %d]: worker exited with status %d\n",
+		       i, WEXITSTATUS(status));
+	}
+	close(fds[i]);
+	fds[i] = -1;
+	stats[i].valid = res.valid;
+	stats[i].util = res.util;
+	stats[i].rss = res.rss;
+	errors += res.errors;
+    }
+    free(pids);
+    free(fds);
+}
+
+/*
+ * eval_cache_modes - Time speed function f on params with the cache
+ *     flushed before every run, after a warm-up run, and after a
+ *     warm-up run with another thread streaming through a cache-sized
+ *     buffer meanwhile. The mean secs of each go in secs.
+ */
+static void eval_cache_modes(fsecs_test_funct f, speed_t *params, 
+			     size_t bytes, double *secs)
+{
+    static int modes[CACHEMODES] = {FSECS_COLD, FSECS_WARM, FSECS_POLLUTED};
+    fsecs_stats_t timing;
+    int m;
+
+    for (m = 0; m < CACHEMODES; m++) {
+	set_fsecs_cache(modes[m], bytes);
+	secs[m] = fsecs_stats(f, params, &timing);
+    }
+    set_fsecs_cache(FSECS_DEFAULT, bytes);
+}
+
+/*
+ * eval_mt_speed - Replay a trace on nthreads threads at the same time,
+ *    either nthreads full copies of it or, if partition is set, one
+ *    share of its block ids per thread. The mm package gets a fresh
+ *    heap for every replay. The best of mt_reps replays is kept.
+ *
+ *    A partitioned trace with thread tags hands each tagged request to
+ *    its thread instead, so blocks can change hands. The threads then
+ *    share one block array, and each request waits until the request
+ *    before it on the same id has been carried out.
+ */
+static void eval_mt_speed(trace_t *trace, int nthreads, int partition,
+			  int use_mm, mtstats_t *stats)
+{
+    pthread_t *tids;
+    mtarg_t *args;
+    pthread_barrier_t barrier;
+    double start, end, secs, lat;
+    char **shared = NULL;
+    int *opseq = NULL, *done = NULL, abort_flag;
+    int i, rep;
+
+    if ((tids = (pthread_t *)malloc(nthreads * sizeof(pthread_t))) == NULL ||
+	(args = (mtarg_t *)calloc(nthreads, sizeof(mtarg_t))) == NULL)
+	unix_error("malloc failed in eval_mt_speed");
+    if (partition && trace->threaded) {
+	if ((shared = (char **)malloc(trace->num_ids * sizeof(char *))) == NULL ||
+	    (opseq = (int *)malloc(trace->num_ops * sizeof(int))) == NULL ||
+	    (done = (int *)calloc(trace->num_ids, sizeof(int))) == NULL)
+	    unix_error("malloc failed in eval_mt_speed");
+	for (i = 0; i < trace->num_ops; i++)
+	    opseq[i] = done[trace->ops[i].index]++;
+    }
+    for (i = 0; i < nthreads; i++) {
+	args[i].trace = trace;
+	args[i].tid = i;
+	args[i].nthreads = nthreads;
+	args[i].partition = partition;
+	args[i].use_mm = use_mm;
+	args[i].barrier = &barrier;
+	args[i].opseq = opseq;
+	args[i].done = done;
+	args[i].abort = &abort_flag;
+	args[i].blocks = shared;
+	if (shared == NULL &&
+	    (args[i].blocks = (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	    unix_error("malloc failed in eval_mt_speed");
+    }
+
+    stats->valid = 0;
+    for (rep = 0; rep < mt_reps; rep++) {
+	if (use_mm) {
+	    mem_reset_brk();
+	    if (backend->init() < 0)
+		app_error("mm_init failed in eval_mt_speed");
+	}
+	if (done != NULL)
+	    memset(done, 0, trace->num_ids * sizeof(int));
+	abort_flag = 0;
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++)
+	    if (pthread_create(&tids[i], NULL, mt_replay, &args[i]) != 0)
+		unix_error("pthread_create failed in eval_mt_speed");
+
+	/* All threads start together once we reach the barrier */
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < nthreads; i++)
+	    pthread_join(tids[i], NULL);
+	pthread_barrier_destroy(&barrier);
+
+	for (i = 0; i < nthreads; i++)
+	    if (args[i].failed)
+		break;
+	if (i < nthreads) {
+	    printf("%s replay of trace on %d threads failed\n", 
+		   use_mm ? "mm" : "libc", nthreads);
+	    stats->valid = 0;
+	    break;
+	}
+
+	/* The replay runs from the first thread's start to the last one's end */
+	start = DBL_MAX;
+	end = 0;
+	for (i = 0; i < nthreads; i++) {
+	    start = (args[i].start < start) ? args[i].start : start;
+	    end = (args[i].start + args[i].secs > end) ? 
+		args[i].start + args[i].secs : end;
+	}
+	secs = end - start;
+
+	if (stats->valid && secs >= stats->secs)
+	    continue;
+
+	stats->valid = 1;
+	stats->secs = secs;
+	stats->ops = 0;
+	stats->min_lat = DBL_MAX;
+	stats->avg_lat = 0;
+	stats->max_lat = 0;
+	for (i = 0; i < nthreads; i++) {
+	    lat = (args[i].ops > 0) ? 1e6 * args[i].secs / args[i].ops : 0;
+	    stats->ops += args[i].ops;
+	    stats->avg_lat += lat / nthreads;
+	    stats->min_lat = (lat < stats->min_lat) ? lat : stats->min_lat;
+	    stats->max_lat = (lat > stats->max_lat) ? lat : stats->max_lat;
+	}
+    }
+
+    if (shared == NULL)
+	for (i = 0; i < nthreads; i++)
+	    free(args[i].blocks);
+    free(shared);
+    free(opseq);
+    free(done);
+    free(args);
+    free(tids);
+}
+
+/*
+ * mt_replay - Thread routine of eval_mt_speed. Waits for the common
+ *    start, then replays its copy or share of a trace.
+ */
+static void *mt_replay(void *ptr)
+{
+    mtarg_t *arg = (mtarg_t *)ptr;
+    trace_t *trace = arg->trace;
+    char **blocks = arg->blocks;
+    int i, j, index, size, count, owner;
+    char *p;
+
+    arg->ops = 0;
+    arg->failed = 0;
+    pthread_barrier_wait(arg->barrier);
+    arg->start = wall_secs();
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+	count = trace->ops[i].count;
+	owner = (trace->ops[i].tid >= 0) ? trace->ops[i].tid : index;
+	if (arg->partition && owner % arg->nthreads != arg->tid)
+	    continue;
+
+	/* The previous request on this id may belong to another thread */
+	if (arg->done != NULL) {
+	    while (__atomic_load_n(&arg->done[index], __ATOMIC_ACQUIRE) != 
+		   arg->opseq[i]) {
+		if (__atomic_load_n(arg->abort, __ATOMIC_RELAXED))
+		    goto fail;
+		sched_yield();
+	    }
+	}
+
+        switch (trace->ops[i].type) {
+        case ALLOC:
+	    p = arg->use_mm ? backend->malloc(size) : malloc(size);
+	    if (p == NULL)
+		goto fail;
+	    blocks[index] = p;
+	    break;
+
+	case REALLOC:
+	    p = arg->use_mm ? backend->realloc(blocks[index], size) 
+		: realloc(blocks[index], size);
+	    if (p == NULL)
+		goto fail;
+	    blocks[index] = p;
+	    break;
+
+        case FREE:
+	    if (arg->use_mm)
+		backend->free(blocks[index]);
+	    else
+		free(blocks[index]);
+	    break;
+
+	case ALLOC_BATCH:
+	    if (arg->use_mm) {
+		if (backend->malloc_batch(size, count, (void **)&blocks[index]) != count)
+		    goto fail;
+		break;
+	    }
+	    for (j = 0; j < count; j++) {
+		if ((blocks[index + j] = malloc(size)) == NULL)
+		    goto fail;
+	    }
+	    break;
+
+	case FREE_BATCH:
+	    if (arg->use_mm)
+		backend->free_batch((void **)&blocks[index], count);
+	    else
+		for (j = 0; j < count; j++)
+		    free(blocks[index + j]);
+	    break;
+	}
+	if (arg->done != NULL)
+	    __atomic_store_n(&arg->done[index], arg->opseq[i] + 1, 
+			     __ATOMIC_RELEASE);
+	arg->ops += count;
+    }
+
+    arg->secs = wall_secs() - arg->start;
+    return NULL;
+
+ fail:
+    arg->failed = 1;
+    __atomic_store_n(arg->abort, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*************************************************************
+ * Loading packages from shared objects and comparing them (-b)
+ ************************************************************/
+
+/*
+ * load_backend - Fill in b with the package built into shared object
+ *     path, or with the linked mm.o for "builtin". The object leaves
+ *     memlib undefined so that it takes the driver's heap. A package
+ *     without the batch calls or the statistics gets stand-ins; one
+ *     without mm_init, mm_malloc, mm_free or mm_realloc is an error.
+ */
+static void load_backend(char *path, backend_t *b)
+{
+    char name[MAXLINE];
+    void *handle;
+
+    if (!strcmp(path, "builtin")) {
+	*b = builtin;
+	return;
+    }
+
+    /* dlopen only searches the library path for a bare file name */
+    snprintf(name, MAXLINE, "%s%s", strchr(path, '/') ? "" : "./", path);
+    if ((handle = dlopen(name, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+	printf("mdriver: could not load %s: %s\n", path, dlerror());
+	exit(1);
+    }
+    b->name = strdup(path);
+    b->init = dlsym(handle, "mm_init");
+    b->malloc = dlsym(handle, "mm_malloc");
+    b->free = dlsym(handle, "mm_free");
+    b->realloc = dlsym(handle, "mm_realloc");
+    if (!b->init || !b->malloc || !b->free || !b->realloc) {
+	printf("mdriver: %s lacks mm_init, mm_malloc, mm_free or mm_realloc\n",
+	       path);
+	exit(1);
+    }
+    if ((b->malloc_batch = dlsym(handle, "mm_malloc_batch")) == NULL ||
+	(b->free_batch = dlsym(handle, "mm_free_batch")) == NULL) {
+	b->malloc_batch = each_malloc_batch;
+	b->free_batch = each_free_batch;
+    }
+    if ((b->stats = dlsym(handle, "mm_stats")) == NULL)
+	b->stats = no_stats;
+    if ((b->seg_stats = dlsym(handle, "mm_seg_stats")) == NULL)
+	b->seg_stats = no_seg_stats;
+    if ((b->malloc_class = dlsym(handle, "mm_malloc_class")) == NULL)
+	b->malloc_class = size_malloc_class;
+    b->plain_malloc = b->malloc;
+    if ((b->malloc_near = dlsym(handle, "mm_malloc_near")) == NULL)
+	b->malloc_near = hintless_malloc_near;
+    if ((b->region_create = dlsym(handle, "mm_region_create")) == NULL ||
+	(b->region_alloc = dlsym(handle, "mm_region_alloc")) == NULL ||
+	(b->region_destroy = dlsym(handle, "mm_region_destroy")) == NULL)
+	b->region_create = NULL;
+    if ((b->checkheap = dlsym(handle, "mm_checkheap")) == NULL)
+	b->checkheap = no_checkheap;
+}
+
+/*
+ * class_malloc - mm_malloc as mm_malloc_fixed compiles it for a constant
+ *     size (-k): a request that fits a fixed size class goes straight to
+ *     mm_malloc_class, the rest to mm_malloc
+ */
+static void *class_malloc(size_t size)
+{
+    if (size > 0 && MM_BLOCKSIZE(size) <= MM_FIXEDLIMIT)
+	return backend->malloc_class(MM_CLASS(size));
+    return backend->plain_malloc(size);
+}
+
+/*
+ * size_malloc_class - mm_malloc_class for a package without it
+ */
+static void *size_malloc_class(int cls)
+{
+    return backend->plain_malloc(MM_MINBLOCK + cls*MM_DSIZE - MM_WSIZE);
+}
+
+/*
+ * near_malloc - mm_malloc as a caller that allocates related objects
+ *     together would use it (-n): each request goes to mm_malloc_near
+ *     with the block the same thread allocated before it as the hint
+ */
+static void *near_malloc(size_t size)
+{
+    static __thread void *last; /* each -T thread replays on its own */
+    void *p;
+
+    if ((p = backend->malloc_near(size, last)) != NULL)
+	last = p;
+    return p;
+}
+
+/*
+ * hintless_malloc_near - mm_malloc_near for a package without it
+ */
+static void *hintless_malloc_near(size_t size, void *hint)
+{
+    return backend->plain_malloc(size);
+}
+
+/*
+ * each_malloc_batch - mm_malloc_batch for a package without it
+ */
+static int each_malloc_batch(size_t size, int n, void **ptrs)
+{
+    int i;
+
+    for (i = 0; i < n && (ptrs[i] = backend->malloc(size)) != NULL; i++)
+	;
+    return i;
+}
+
+/*
+ * each_free_batch - mm_free_batch for a package without it
+ */
+static void each_free_batch(void **ptrs, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+	backend->free(ptrs[i]);
+}
+
+/*
+ * no_stats - mm_stats for a package without it
+ */
+static void no_stats(mm_stats_t *stats)
+{
+    memset(stats, 0, sizeof(mm_stats_t));
+}
+
+/*
+ * no_seg_stats - mm_seg_stats for a package without size classes
+ */
+static int no_seg_stats(int cls, size_t *size, long *hits, long *misses)
+{
+    return 0;
+}
+
+/*
+ * no_checkheap - mm_checkheap for a package without a heap checker
+ */
+static int no_checkheap(int verbose)
+{
+    return 0;
+}
+
+/*
+ * compare_backends - Run every trace with each of the nb packages in
+ *     turn, then print them side by side, each against the first, and
+ *     write them to json if it is set. The packages take turns trace by
+ *     trace, so that a drift in the machine's speed over the run does
+ *     not end up between them. Returns the exit status for
+ *     main: 2 if some package regressed against the first, see
+ *     regressed, else 0.
+ */
+static int compare_backends(backend_t *backends, int nb, char **tracefiles,
+			    int num_tracefiles, int jobs, int unbatch, 
+			    size_t max_heap, int hugepages, int nthreads, 
+			    int partition, double regress_pct, FILE *json)
+{
+    stats_t *stats[MAXBACKENDS];
+    mtstats_t *mtstats[MAXBACKENDS];
+    int errs[MAXBACKENDS];
+    char why[MAXLINE];
+    trace_t *trace;
+    int b, i, status = 0;
+
+    for (b = 0; b < nb; b++) {
+	if ((stats[b] = calloc(num_tracefiles, sizeof(stats_t))) == NULL ||
+	    (mtstats[b] = calloc(num_tracefiles, sizeof(mtstats_t))) == NULL)
+	    unix_error("calloc failed in compare_backends");
+	backend = &backends[b];
+	errors = 0;
+	if (jobs > 1)
+	    eval_mm_parallel(tracefiles, num_tracefiles, jobs, unbatch,
+			     max_heap, hugepages, stats[b]);
+	errs[b] = errors;
+    }
+
+    for (i = 0; i < num_tracefiles; i++) {
+	trace = read_trace(tracedir, tracefiles[i]);
+	if (unbatch)
+	    unbatch_trace(trace);
+	for (b = 0; b < nb; b++) {
+	    if (jobs > 1 && (debug || !stats[b][i].valid))
+		continue;
+	    if (verbose > 1)
+		printf("Testing [%d] %s\n", b, backends[b].name);
+	    backend = &backends[b];
+	    errors = errs[b];
+	    eval_backend(trace, i, jobs, nthreads, partition, &stats[b][i],
+			 &mtstats[b][i]);
+	    errs[b] = errors;
+	}
+	free_trace(trace);
+    }
+
+    printf("\n");
+    printcompare(nb, backends, num_tracefiles, stats, errs);
+    if (nthreads && !debug) {
+	printf("\n");
+	printmtcompare(nb, num_tracefiles, mtstats, nthreads, partition);
+    }
+    printf("\n");
+    for (b = 1; b < nb; b++) {
+	if (regressed(stats[0], stats[b], num_tracefiles, errs[b], 
+		      regress_pct, why)) {
+	    printf("Regression in [%d] %s: %s\n", b, backends[b].name, why);
+	    status = 2;
+	}
+    }
+    if (status == 0)
+	printf("No regressions against [0] %s\n", backends[0].name);
+
+    if (json != NULL) {
+	writejson(json, nb, backends, stats, nthreads ? mtstats : NULL,
+		  num_tracefiles, tracefiles, errs, regress_pct);
+	fclose(json);
+    }
+    return status;
+}
+
+/*
+ * eval_backend - Check trace number i with the current package and,
+ *     unless debugging, measure its utilization and time it, on
+ *     nthreads as well if that is set. With -j, eval_mm_parallel has
+ *     already done the checks.
+ */
+static void eval_backend(trace_t *trace, int i, int jobs, int nthreads,
+			 int partition, stats_t *stats, mtstats_t *mtstats)
+{
+    range_t *ranges = NULL;
+    speed_t speed_params;
+    fsecs_stats_t timing;
+
+    stats->ops = trace_calls(trace);
+    if (jobs == 1)
+	stats->valid = eval_mm_valid(trace, i, &ranges);
+    if (!stats->valid || debug)
+	return;
+    if (jobs == 1)
+	stats->util = eval_mm_util(trace, i, &ranges, &stats->rss);
+    speed_params.trace = trace;
+    speed_params.ranges = ranges;
+    stats->secs = fsecs_stats(eval_mm_speed, &speed_params, &timing);
+    stats->median = timing.median;
+    stats->ci = timing.ci;
+    stats->reps = timing.reps;
+    if (nthreads)
+	eval_mt_speed(trace, nthreads, partition, 1, mtstats);
+}
+
+/*
+ * compare_secs - Compare the total secs of base and stats over the n
+ *     traces both ran correctly, with Welch's t test: speedup is how
+ *     many times faster stats ran, and t the test statistic. Returns 1
+ *     if the two differ at the 95% level, 0 if not, and -1 if there is
+ *     no spread to test with (fcyc times each trace once).
+ */
+static int compare_secs(stats_t *base, stats_t *stats, int n, 
+			double *speedup, double *t)
+{
+    double secs[2] = {0, 0}, var = 0, dfdiv = 0, se;
+    stats_t *s;
+    int i, k;
+
+    for (i = 0; i < n; i++) {
+	if (!base[i].valid || !stats[i].valid)
+	    continue;
+	for (k = 0; k < 2; k++) {
+	    s = k ? &stats[i] : &base[i];
+	    secs[k] += s->secs;
+	    if (s->reps > 1) {
+		/* Satterthwaite's degrees of freedom for the sum */
+		se = s->ci / fsecs_t95(s->reps - 1);
+		var += se * se;
+		dfdiv += se * se * se * se / (s->reps - 1);
+	    }
 	}
     }
+    *speedup = (secs[1] > 0) ? secs[0] / secs[1] : 0;
+    *t = 0;
+    if (var == 0 || dfdiv == 0)
+	return (secs[0] == secs[1]) ? 0 : -1;
+    *t = (secs[0] - secs[1]) / sqrt(var);
+    return fabs(*t) > fsecs_t95(var * var / dfdiv);
+}
+
+/*
+ * regressed - Return 1, with the reason in why, if stats fails a trace
+ *     that base runs correctly, or made errs errors; or if its average
+ *     utilization or its total throughput is more than pct percent
+ *     below that of base, the latter significantly (or, with no spread
+ *     to test with, at all)
+ */
+static int regressed(stats_t *base, stats_t *stats, int n, int errs,
+		     double pct, char *why)
+{
+    double util[2] = {0, 0}, speedup, t;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	if (base[i].valid && !stats[i].valid) {
+	    sprintf(why, "trace %d is no longer valid", i);
+	    return 1;
+	}
+	util[0] += base[i].util;
+	util[1] += stats[i].util;
+    }
+    if (errs > 0) {
+	sprintf(why, "%d errors", errs);
+	return 1;
+    }
+    if (debug)
+	return 0;
+    if (util[1] < util[0] * (1 - pct/100)) {
+	sprintf(why, "utilization %.1f%% against %.1f%%", 
+		100*util[1]/n, 100*util[0]/n);
+	return 1;
+    }
+    if (compare_secs(base, stats, n, &speedup, &t) != 0 && 
+	speedup < 1 - pct/100) {
+	sprintf(why, "throughput %.1f%% lower (t = %.2f)", 
+		100*(1 - speedup), t);
+	return 1;
+    }
+    return 0;
 }
 
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
 
+/*
+ * wall_secs - Return the current wall clock time in seconds
+ */
+static double wall_secs(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1E-6 * tv.tv_usec;
+}
+
+
+/*
+ * perf_index - The performance index, out of 100, of a package with the
+ *     given average utilization and throughput; p1 and p2 get the
+ *     shares of utilization and throughput in it, out of 1
+ */
+static double perf_index(double util, double throughput, double *p1, 
+			 double *p2)
+{
+    *p1 = UTIL_WEIGHT * util;
+    if (throughput > AVG_LIBC_THRUPUT) {
+	*p2 = (double)(1.0 - UTIL_WEIGHT);
+    } 
+    else {
+	*p2 = ((double) (1.0 - UTIL_WEIGHT)) * 
+	    (throughput/AVG_LIBC_THRUPUT);
+    }
+    return (*p1 + *p2)*100.0;
+}
 
 /*
  * printresults - prints a performance summary for some malloc package
@@ -935,54 +2675,638 @@ static void printresults(int n, stats_t *stats)
     double secs = 0;
     double ops = 0;
     double util = 0;
+    double var = 0;  /* of the total secs, with the traces independent */
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
-	   "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%7s%8s%10s%10s%6s%6s\n", 
+	   "trace", " valid", "util", "rssKB", "ops", "secs", "median", 
+	   "+-%", "Kops");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%7.0f%8.0f%10.6f%10.6f%6.1f%6.0f\n", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
+		   stats[i].rss/1024,
 		   stats[i].ops,
 		   stats[i].secs,
+		   stats[i].median,
+		   100.0*stats[i].ci/stats[i].secs,
 		   (stats[i].ops/1e3)/stats[i].secs);
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
+	    var += stats[i].ci * stats[i].ci;
 	}
 	else {
-	    printf("%2d%10s%6s%8s%10s%6s\n", 
+	    printf("%2d%10s%6s%7s%8s%10s%10s%6s%6s\n", 
 		   i,
 		   "no",
 		   "-",
 		   "-",
 		   "-",
+		   "-",
+		   "-",
+		   "-",
 		   "-");
 	}
     }
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-	printf("%12s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	printf("%12s%5.0f%%%7s%8.0f%10.6f%10s%6.1f%6.0f\n", 
 	       "Total       ",
 	       (util/n)*100.0,
+	       "",
 	       ops, 
 	       secs,
+	       "",
+	       100.0*sqrt(var)/secs,
 	       (ops/1e3)/secs);
     }
     else {
-	printf("%12s%6s%8s%10s%6s\n", 
+	printf("%12s%6s%7s%8s%10s%10s%6s%6s\n", 
 	       "Total       ",
 	       "-", 
+	       "", 
 	       "-", 
 	       "-", 
+	       "",
+	       "-", 
 	       "-");
     }
 
 }
 
+/*
+ * printmtresults - prints a summary of the multithreaded replays of
+ *     some malloc package: aggregate throughput and the spread of the
+ *     per-thread average latencies
+ */
+static void printmtresults(int n, mtstats_t *stats, int nthreads, 
+			   int partition)
+{
+    int i;
+    double secs = 0;
+    double ops = 0;
+    int valid = 1;
+
+    printf("%d %s, best of %d runs, latency in usecs/op per thread\n",
+	   nthreads, partition ? "partitions" : "copies", mt_reps);
+    printf("%5s%7s %9s%10s%8s%9s%9s%9s\n", 
+	   "trace", " valid", "ops", "secs", "Kops", "min lat", "avg lat", 
+	   "max lat");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid) {
+	    printf("%2d%10s%9.0f%10.6f%8.0f%9.3f%9.3f%9.3f\n", 
+		   i,
+		   "yes",
+		   stats[i].ops,
+		   stats[i].secs,
+		   (stats[i].ops/1e3)/stats[i].secs,
+		   stats[i].min_lat,
+		   stats[i].avg_lat,
+		   stats[i].max_lat);
+	    secs += stats[i].secs;
+	    ops += stats[i].ops;
+	}
+	else {
+	    printf("%2d%10s%9s%10s%8s%9s%9s%9s\n", 
+		   i, "no", "-", "-", "-", "-", "-", "-");
+	    valid = 0;
+	}
+    }
+
+    /* Print the aggregate throughput for the set of traces */
+    if (valid) 
+	printf("%12s%9.0f%10.6f%8.0f\n", "Total       ", ops, secs, 
+	       (ops/1e3)/secs);
+    else
+	printf("%12s%9s%10s%8s\n", "Total       ", "-", "-", "-");
+}
+
+/*
+ * printcompare - prints the utilization, throughput and mean latency of
+ *     nb packages side by side, with the throughput of each package
+ *     after the first as a change from the first's, starred where
+ *     compare_secs finds it significant
+ */
+static void printcompare(int nb, backend_t *backends, int n, stats_t **stats,
+			 int *errs)
+{
+    double util, secs, ops, speedup, t, p1, p2;
+    char label[16];
+    int b, i, sig;
+
+    printf("Packages side by side, latency in usecs/op, change in Kops\n"
+	   "against [0], * where significant (Welch's t test, 95%%):\n");
+    for (b = 0; b < nb; b++)
+	printf("  [%d] %s\n", b, backends[b].name);
+
+    printf("%5s", "trace");
+    for (b = 0; b < nb; b++) {
+	sprintf(label, "[%d]", b);
+	printf("%5s%5s%7s%7s", label, "util", "Kops", "lat");
+	if (b > 0)
+	    printf("%10s", "change");
+    }
+    printf("\n");
+
+    for (i = 0; i < n; i++) {
+	printf("%5d", i);
+	for (b = 0; b < nb; b++) {
+	    if (stats[b][i].valid && !debug)
+		printf("%5s%4.0f%%%7.0f%7.3f", "", stats[b][i].util*100.0,
+		       (stats[b][i].ops/1e3)/stats[b][i].secs,
+		       1e6*stats[b][i].secs/stats[b][i].ops);
+	    else
+		printf("%5s%5s%7s%7s", stats[b][i].valid ? "" : "no", 
+		       "-", "-", "-");
+	    if (b == 0)
+		continue;
+	    if (stats[0][i].valid && stats[b][i].valid && !debug) {
+		sig = compare_secs(&stats[0][i], &stats[b][i], 1, &speedup, &t);
+		printf("%+8.1f%%%c", 100*(speedup - 1), sig > 0 ? '*' : ' ');
+	    }
+	    else
+		printf("%10s", "-");
+	}
+	printf("\n");
+    }
+    if (debug)
+	return;
+
+    /* The aggregate results, as in printresults */
+    printf("%5s", "Total");
+    for (b = 0; b < nb; b++) {
+	util = secs = ops = 0;
+	for (i = 0; i < n; i++) {
+	    if (stats[b][i].valid) {
+		util += stats[b][i].util;
+		secs += stats[b][i].secs;
+		ops += stats[b][i].ops;
+	    }
+	}
+	if (errs[b] == 0 && secs > 0)
+	    printf("%5s%4.0f%%%7.0f%7.3f", "", 100*util/n, (ops/1e3)/secs,
+		   1e6*secs/ops);
+	else
+	    printf("%5s%5s%7s%7s", "", "-", "-", "-");
+	if (b == 0)
+	    continue;
+	if (errs[0] == 0 && errs[b] == 0) {
+	    sig = compare_secs(stats[0], stats[b], n, &speedup, &t);
+	    printf("%+8.1f%%%c", 100*(speedup - 1), sig > 0 ? '*' : ' ');
+	}
+	else
+	    printf("%10s", "-");
+    }
+    printf("\n");
+
+    for (b = 0; b < nb; b++) {
+	util = secs = ops = 0;
+	for (i = 0; i < n; i++) {
+	    util += stats[b][i].util;
+	    secs += stats[b][i].secs;
+	    ops += stats[b][i].ops;
+	}
+	if (errs[b] == 0)
+	    printf("Perf index [%d] = %.0f/100\n", b, 
+		   perf_index(util/n, ops/secs, &p1, &p2));
+	else
+	    printf("Perf index [%d] = -, terminated with %d errors\n", 
+		   b, errs[b]);
+    }
+}
+
+/*
+ * printmtcompare - prints the multithreaded replays of nb packages side
+ *     by side, with the throughput of each package after the first as
+ *     a change from the first's. Only the best replay is kept, so there
+ *     is no spread to test the change with.
+ */
+static void printmtcompare(int nb, int n, mtstats_t **stats, int nthreads,
+			   int partition)
+{
+    double secs[MAXBACKENDS], ops[MAXBACKENDS];
+    char label[16];
+    int b, i, valid[MAXBACKENDS];
+
+    printf("On %d threads, %d %s, best of %d runs, average latency in\n"
+	   "usecs/op per thread, change in Kops against [0]:\n",
+	   nthreads, nthreads, partition ? "partitions" : "copies", mt_reps);
+    printf("%5s", "trace");
+    for (b = 0; b < nb; b++) {
+	sprintf(label, "[%d]", b);
+	printf("%5s%8s%9s", label, "Kops", "avg lat");
+	if (b > 0)
+	    printf("%10s", "change");
+	secs[b] = ops[b] = 0;
+	valid[b] = 1;
+    }
+    printf("\n");
+
+    for (i = 0; i < n; i++) {
+	printf("%5d", i);
+	for (b = 0; b < nb; b++) {
+	    if (stats[b][i].valid) {
+		printf("%5s%8.0f%9.3f", "", 
+		       (stats[b][i].ops/1e3)/stats[b][i].secs, 
+		       stats[b][i].avg_lat);
+		secs[b] += stats[b][i].secs;
+		ops[b] += stats[b][i].ops;
+	    }
+	    else {
+		printf("%5s%8s%9s", "", "-", "-");
+		valid[b] = 0;
+	    }
+	    if (b == 0)
+		continue;
+	    if (stats[0][i].valid && stats[b][i].valid)
+		printf("%+9.1f%%", 100*((stats[0][i].secs/stats[0][i].ops) / 
+				       (stats[b][i].secs/stats[b][i].ops) - 1));
+	    else
+		printf("%10s", "-");
+	}
+	printf("\n");
+    }
+
+    printf("%5s", "Total");
+    for (b = 0; b < nb; b++) {
+	if (valid[b])
+	    printf("%5s%8.0f%9s", "", (ops[b]/1e3)/secs[b], "");
+	else
+	    printf("%5s%8s%9s", "", "-", "");
+	if (b == 0)
+	    continue;
+	if (valid[0] && valid[b])
+	    printf("%+9.1f%%", 100*((secs[0]/ops[0]) / (secs[b]/ops[b]) - 1));
+	else
+	    printf("%10s", "-");
+    }
+    printf("\n");
+}
+
+/*
+ * jsonstr - prints s as a JSON string
+ */
+static void jsonstr(FILE *fp, char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+	if (*s == '"' || *s == '\\')
+	    fputc('\\', fp);
+	if ((unsigned char)*s >= ' ')
+	    fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+/*
+ * writejson - writes the results of nb packages to fp as one JSON
+ *     object: a member of "backends" per package, with its results for
+ *     every trace and in total, and, for each package after the first,
+ *     its comparison with the first as in printcompare and regressed.
+ *     mtstats is NULL without -T.
+ */
+static void writejson(FILE *fp, int nb, backend_t *backends, stats_t **stats,
+		      mtstats_t **mtstats, int n, char **tracefiles, int *errs,
+		      double regress_pct)
+{
+    double util, secs, ops, speedup, t, p1, p2;
+    char why[MAXLINE];
+    int b, i, sig, any = 0;
+    stats_t *s;
+
+    fprintf(fp, "{\n  \"timer\": \"%s\",\n  \"regress_pct\": %g,\n"
+	    "  \"backends\": [\n", fsecs_timer_name(), regress_pct);
+    for (b = 0; b < nb; b++) {
+	fprintf(fp, "    {\n      \"name\": ");
+	jsonstr(fp, backends[b].name);
+	fprintf(fp, ",\n      \"errors\": %d,\n      \"traces\": [\n", errs[b]);
+
+	util = secs = ops = 0;
+	for (i = 0; i < n; i++) {
+	    s = &stats[b][i];
+	    fprintf(fp, "        {\"trace\": ");
+	    jsonstr(fp, tracefiles[i]);
+	    fprintf(fp, ", \"valid\": %s", s->valid ? "true" : "false");
+	    if (s->valid && !debug) {
+		fprintf(fp, ", \"util\": %.6f, \"rss_kb\": %.0f, \"ops\": %.0f,"
+			" \"secs\": %.9f, \"median\": %.9f, \"ci\": %.9f,"
+			" \"reps\": %d, \"kops\": %.3f, \"lat_usecs\": %.6f",
+			s->util, s->rss/1024, s->ops, s->secs, s->median, s->ci,
+			s->reps, (s->ops/1e3)/s->secs, 1e6*s->secs/s->ops);
+		if (mtstats != NULL && mtstats[b][i].valid)
+		    fprintf(fp, ", \"mt_kops\": %.3f, \"mt_min_lat\": %.6f,"
+			    " \"mt_avg_lat\": %.6f, \"mt_max_lat\": %.6f",
+			    (mtstats[b][i].ops/1e3)/mtstats[b][i].secs,
+			    mtstats[b][i].min_lat, mtstats[b][i].avg_lat,
+			    mtstats[b][i].max_lat);
+		if (b > 0 && stats[0][i].valid) {
+		    sig = compare_secs(&stats[0][i], s, 1, &speedup, &t);
+		    fprintf(fp, ", \"speedup\": %.6f, \"t\": %.4f,"
+			    " \"significant\": %s", speedup, t,
+			    sig < 0 ? "null" : sig ? "true" : "false");
+		}
+		util += s->util;
+		secs += s->secs;
+		ops += s->ops;
+	    }
+	    fprintf(fp, "}%s\n", (i < n-1) ? "," : "");
+	}
+	fprintf(fp, "      ]");
+
+	if (errs[b] == 0 && !debug && secs > 0) {
+	    fprintf(fp, ",\n      \"total\": {\"util\": %.6f, \"ops\": %.0f,"
+		    " \"secs\": %.9f, \"kops\": %.3f, \"perfindex\": %.1f",
+		    util/n, ops, secs, (ops/1e3)/secs, 
+		    perf_index(util/n, ops/secs, &p1, &p2));
+	    if (b > 0 && errs[0] == 0) {
+		sig = compare_secs(stats[0], stats[b], n, &speedup, &t);
+		fprintf(fp, ", \"speedup\": %.6f, \"t\": %.4f,"
+			" \"significant\": %s", speedup, t,
+			sig < 0 ? "null" : sig ? "true" : "false");
+	    }
+	    fprintf(fp, "}");
+	}
+	if (b > 0) {
+	    sig = regressed(stats[0], stats[b], n, errs[b], regress_pct, why);
+	    fprintf(fp, ",\n      \"regression\": %s", sig ? "true" : "false");
+	    if (sig) {
+		fprintf(fp, ",\n      \"reason\": ");
+		jsonstr(fp, why);
+	    }
+	    any |= sig;
+	}
+	fprintf(fp, "\n    }%s\n", (b < nb-1) ? "," : "");
+    }
+    fprintf(fp, "  ],\n  \"regression\": %s\n}\n", any ? "true" : "false");
+}
+
+#if LATENCY_HIST
+/*
+ * hist_add - Record one call of the given number of cycles
+ */
+static void hist_add(hist_t *h, double cycles)
+{
+    unsigned long long c = (cycles > 0) ? (unsigned long long)cycles : 0;
+    int e, b;
+
+    if (c < HISTSUB)
+	b = c;
+    else {
+	e = 63 - __builtin_clzll(c);
+	b = (e - 2) * HISTSUB + ((c >> (e - 3)) & (HISTSUB - 1));
+    }
+    h->count[b]++;
+    h->n++;
+    if (cycles > h->max)
+	h->max = cycles;
+}
+
+/*
+ * hist_percentile - Return the upper bound of the bucket that holds
+ *     the q-th quantile of the recorded calls
+ */
+static double hist_percentile(hist_t *h, double q)
+{
+    unsigned long rank, seen = 0;
+    int b, e;
+
+    if (h->n == 0)
+	return 0;
+
+    rank = (unsigned long)(q * h->n);
+    if (rank >= h->n)
+	rank = h->n - 1;
+    for (b = 0; b < HISTBUCKETS; b++) {
+	seen += h->count[b];
+	if (seen > rank)
+	    break;
+    }
+
+    if (b < HISTSUB)
+	return b;
+    e = b / HISTSUB + 2;
+    return (double)((((unsigned long long)HISTSUB + b % HISTSUB + 1) << (e - 3)) - 1);
+}
+
+/*
+ * printlatency - prints the latency percentiles of each op type on
+ *     each trace
+ */
+static void printlatency(int n, latstats_t (*stats)[3])
+{
+    static char *opnames[3] = {"malloc", "free", "realloc"};
+    int i, op;
+
+    printf("%5s%9s%9s%9s%9s%9s%10s\n", 
+	   "trace", "op", "calls", "p50", "p99", "p999", "max");
+    for (i=0; i < n; i++) {
+	for (op = 0; op < 3; op++) {
+	    if (stats[i][op].calls == 0)
+		continue;
+	    printf("%2d%12s%9lu%9.0f%9.0f%9.0f%10.0f\n", 
+		   i,
+		   opnames[op],
+		   stats[i][op].calls,
+		   stats[i][op].p50,
+		   stats[i][op].p99,
+		   stats[i][op].p999,
+		   stats[i][op].max);
+	}
+    }
+}
+#endif
+
+/*
+ * printevents - prints the hardware events of each trace's speed run
+ *     (-p) divided by its ops; "-" marks events the CPU or the kernel
+ *     would not count
+ */
+static void printevents(int n, stats_t *stats)
+{
+    double total[PERF_EVENTS], ops = 0;
+    int i, e;
+
+    printf("%5s", "trace");
+    for (e = 0; e < PERF_EVENTS; e++)
+	printf("%9s", perf_event_names[e]);
+    printf("%7s\n", "IPC");
+    for (e = 0; e < PERF_EVENTS; e++)
+	total[e] = 0;
+    for (i = 0; i < n; i++) {
+	printf("%2d   ", i);
+	for (e = 0; e < PERF_EVENTS; e++) {
+	    if (!stats[i].valid || stats[i].events[e] < 0) {
+		printf("%9s", "-");
+		total[e] = -1;
+		continue;
+	    }
+	    printf("%9.2f", stats[i].events[e] / stats[i].ops);
+	    if (total[e] >= 0)
+		total[e] += stats[i].events[e];
+	}
+	if (stats[i].valid && stats[i].events[PERF_CYCLES] > 0 &&
+	    stats[i].events[PERF_INSTRUCTIONS] >= 0)
+	    printf("%7.2f\n", stats[i].events[PERF_INSTRUCTIONS] / 
+		   stats[i].events[PERF_CYCLES]);
+	else
+	    printf("%7s\n", "-");
+	if (stats[i].valid)
+	    ops += stats[i].ops;
+    }
+
+    printf("Total");
+    for (e = 0; e < PERF_EVENTS; e++) {
+	if (total[e] < 0 || ops == 0)
+	    printf("%9s", "-");
+	else
+	    printf("%9.2f", total[e] / ops);
+    }
+    if (total[PERF_CYCLES] > 0 && total[PERF_INSTRUCTIONS] >= 0)
+	printf("%7.2f\n", total[PERF_INSTRUCTIONS] / total[PERF_CYCLES]);
+    else
+	printf("%7s\n", "-");
+}
+
+/*
+ * printcache - prints the throughput of each trace in each cache state
+ *     (-C), and how much of the warm throughput survives the others
+ */
+static void printcache(int n, stats_t *stats, size_t bytes)
+{
+    double ops = 0, secs[CACHEMODES] = {0};
+    int i, m;
+
+    if (bytes > 0)
+	printf("Kops/sec; the cache is flushed and polluted with %lu MB\n",
+	       (unsigned long)(bytes >> 20));
+    else
+	printf("Kops/sec; the cache is flushed and polluted with an LLC-sized buffer\n");
+    printf("%5s%9s%9s%9s%9s%7s%7s\n", 
+	   "trace", "ops", "cold", "warm", "polluted", "cold%", "poll%");
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid) {
+	    printf("%2d%12s%9s%9s%9s%7s%7s\n", i, "-", "-", "-", "-", "-", "-");
+	    continue;
+	}
+	printf("%2d%12.0f%9.0f%9.0f%9.0f%6.0f%%%6.0f%%\n", 
+	       i,
+	       stats[i].ops,
+	       stats[i].ops/1e3/stats[i].cache_secs[0],
+	       stats[i].ops/1e3/stats[i].cache_secs[1],
+	       stats[i].ops/1e3/stats[i].cache_secs[2],
+	       100.0*stats[i].cache_secs[1]/stats[i].cache_secs[0],
+	       100.0*stats[i].cache_secs[1]/stats[i].cache_secs[2]);
+	ops += stats[i].ops;
+	for (m = 0; m < CACHEMODES; m++)
+	    secs[m] += stats[i].cache_secs[m];
+    }
+    if (ops > 0)
+	printf("%5s%9.0f%9.0f%9.0f%9.0f%6.0f%%%6.0f%%\n", 
+	       "Total",
+	       ops,
+	       ops/1e3/secs[0], 
+	       ops/1e3/secs[1], 
+	       ops/1e3/secs[2],
+	       100.0*secs[1]/secs[0],
+	       100.0*secs[1]/secs[2]);
+}
+
+/*
+ * printstats - prints the allocator-internal statistics of each trace:
+ *     tree nodes visited per search, splits by side, coalesce cases,
+ *     extensions, trims, reallocs and mappings, then the free blocks at
+ *     peak payload by power of two size and the quick-list hit rate
+ */
+static void printstats(int n, mm_stats_t *stats)
+{
+    int i, b, lo = MM_SIZEBINS, hi = -1;
+    char label[16];
+
+    printf("%5s%8s%7s%7s%7s%7s%7s%7s%7s%6s%6s%7s%6s%7s%6s%6s\n", 
+	   "trace", "visits", "front", "back", "coal1", "coal2", "coal3",
+	   "coal4", "extend", "trim", "depth", "inpl", "prev", "copy", "mmap",
+	   "remap");
+    for (i=0; i < n; i++) {
+	printf("%2d%11.1f%7ld%7ld%7ld%7ld%7ld%7ld%7ld%6ld%6d%7ld%6ld%7ld%6ld%6ld\n", 
+	       i,
+	       stats[i].ceiling_calls ? 
+	       (double)stats[i].ceiling_visits / stats[i].ceiling_calls : 0.0,
+	       stats[i].split_front,
+	       stats[i].split_back,
+	       stats[i].coalesce[0],
+	       stats[i].coalesce[1],
+	       stats[i].coalesce[2],
+	       stats[i].coalesce[3],
+	       stats[i].extends,
+	       stats[i].trims,
+	       stats[i].tree_depth,
+	       stats[i].realloc_inplace,
+	       stats[i].realloc_prev,
+	       stats[i].realloc_copy,
+	       stats[i].mmaps,
+	       stats[i].remaps);
+	for (b = 0; b < MM_SIZEBINS; b++) {
+	    if (stats[i].free_bins[b]) {
+		lo = (b < lo) ? b : lo;
+		hi = (b > hi) ? b : hi;
+	    }
+	}
+    }
+
+    /* Free block size distribution, over the bins some trace used */
+    printf("\nFree blocks at peak payload, by size:\n");
+    printf("%5s%7s%9s", "trace", "blocks", "KB");
+    for (b = lo; b <= hi; b++) {
+	sprintf(label, "2^%d", b + 4);
+	printf("%8s", label);
+    }
+    printf("\n");
+    for (i=0; i < n; i++) {
+	printf("%2d%10ld%9.1f", i, stats[i].free_blocks, 
+	       stats[i].free_bytes / 1024.0);
+	for (b = lo; b <= hi; b++)
+	    printf("%8ld", stats[i].free_bins[b]);
+	printf("\n");
+    }
+
+    /* Deferred free reuse, for a package built with a quick-list */
+    for (i=0; i < n; i++)
+	if (stats[i].quick_hits + stats[i].quick_misses > 0)
+	    break;
+    if (i == n)
+	return;
+    printf("\nDeferred frees:\n");
+    printf("%5s%9s%7s%9s\n", "trace", "lookups", "hits", "flushes");
+    for (i=0; i < n; i++) {
+	long lookups = stats[i].quick_hits + stats[i].quick_misses;
+
+	printf("%2d%12ld%6.0f%%%9ld\n", i, lookups,
+	       lookups ? 100.0 * stats[i].quick_hits / lookups : 0.0,
+	       stats[i].quick_flushes);
+    }
+}
+
+/*
+ * printclasses - prints the size class hit/miss counts of the last
+ *     mm run, so the size class cutoff in mm.c can be tuned
+ */
+static void printclasses(void)
+{
+    int cls;
+    size_t size;
+    long hits, misses;
+
+    printf("%8s%10s%10s\n", "class", "hits", "misses");
+    for (cls = 0; backend->seg_stats(cls, &size, &hits, &misses); cls++) {
+	if (hits || misses)
+	    printf("%8u%10ld%10ld\n", (unsigned)size, hits, misses);
+    }
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -1015,14 +3339,45 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValPpsHBknr] [-f <file>] [-t <dir>] [-T <n>] [-m <MB>] [-j <n>]\n"
+	    "              [-c <timer>] [-C <MB>] [-F <file>] [-i <n>] [-b <lib>]...\n"
+	    "              [-J <file>] [-R <pct>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-b <lib>   Run the package in shared object <lib> (\"builtin\" for\n"
+	    "\t           mm.o); given more than once, compare them against the first.\n");
+    fprintf(stderr, "\t-B         Replay batch requests one block at a time.\n");
+    fprintf(stderr, "\t-c <timer> Time with fcyc, itimer, gettod, clock or tsc.\n");
+    fprintf(stderr, "\t-C <MB>    Also time cold, warm and polluted caches, flushing\n"
+	    "\t           MB megabytes (0 for the size of the LLC).\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-F <file>  Write the heap's fragmentation over time to a CSV file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H         Back the heap with transparent huge pages.\n");
+    fprintf(stderr, "\t-i <n>     With -F, sample every n requests (default %d).\n",
+	    FRAGINTERVAL);
+    fprintf(stderr, "\t-j <n>     Check n traces at once; timing stays serial.\n");
+    fprintf(stderr, "\t-J <file>  Write the results as JSON to <file>.\n");
+    fprintf(stderr, "\t-k         Allocate up to %d byte blocks through mm_malloc_class,\n"
+	    "\t           as mm_malloc_fixed does for a constant size.\n", 
+	    MM_FIXEDLIMIT);
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-m <MB>    Reserve MB megabytes for the heap (default %d).\n",
+	    MAX_HEAP >> 20);
+    fprintf(stderr, "\t-n         Allocate through mm_malloc_near, hinting at the block\n"
+	    "\t           the same replay allocated last.\n");
+    fprintf(stderr, "\t-p         Count hardware events per op in the speed runs.\n");
+    fprintf(stderr, "\t-r         Also allocate each block of a trace from a region, and\n"
+	    "\t           destroy it every %d requests and check the heap.\n",
+	    REGIONSPAN);
+    fprintf(stderr, "\t-R <pct>   With several -b, exit with status 2 if a package is\n"
+	    "\t           pct%% slower or less utilized than the first (default %d).\n",
+	    REGRESSPCT);
+    fprintf(stderr, "\t-s         Print the allocator's internal statistics.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Also replay each trace on n threads at once.\n");
+    fprintf(stderr, "\t-P         With -T, split each trace across the threads.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
     fprintf(stderr, "\t-d <n>     Omit timing, debug = n. So execute code: if (debug == n)...\n");
@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE          /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -14,23 +15,71 @@
 #include "memlib.h"
 #include "config.h"
 
+/* 
+ * Regions handed out by mem_map live outside the heap. Each starts
+ * with this header, which links it into the list of live regions.
+ * Its size keeps the region's data ALIGNMENT-aligned.
+ */
+typedef struct mapping_t {
+    struct mapping_t *next;
+    struct mapping_t *prev;
+    size_t size;             /* bytes mapped, header included */
+    size_t pad;
+} mapping_t;
+
+static int mem_commit(char *addr);
+
+#define COMMITSIZE (64*1024)     /* pages are committed this many at a time */
+#define HUGEPAGESIZE (2*1024*1024) /* ... or a huge page at a time */
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_commit_addr; /* end of the readable and writable pages */
+static char *mem_reserve;    /* the reserved mapping ... */
+static size_t mem_reserve_size; /* ... and its size */
+static size_t mem_commit_size; /* commit granularity */
+static mapping_t *mem_mappings; /* regions made by mem_map */
+static size_t mem_mapped;    /* total bytes in those regions */
 
 /* 
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model with the default
+ *    MAX_HEAP bytes of regular pages
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    mem_init_size(MAX_HEAP, 0);
+}
+
+/* 
+ * mem_init_size - initialize the memory system model. Reserves max_heap
+ *    bytes of address space without committing any of it; pages become
+ *    accessible as mem_sbrk moves the brk over them. If hugepages is
+ *    set, the range is aligned and advised for transparent huge pages.
+ */
+void mem_init_size(size_t max_heap, int hugepages)
+{
+    size_t align = hugepages ? HUGEPAGESIZE : mem_pagesize();
+
+    max_heap = (max_heap + align-1) & ~(align-1);
+    mem_reserve_size = max_heap + (hugepages ? HUGEPAGESIZE : 0);
+    mem_reserve = mmap(NULL, mem_reserve_size, PROT_NONE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_reserve == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
+    mem_start_brk = (char *)(((size_t)mem_reserve + align-1) & ~(align-1));
+
+#ifdef MADV_HUGEPAGE
+    if (hugepages && madvise(mem_start_brk, max_heap, MADV_HUGEPAGE) < 0)
+	fprintf(stderr, "mem_init_vm: huge pages unavailable\n");
+#endif
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
+    mem_commit_size = hugepages ? HUGEPAGESIZE : COMMITSIZE;
+    mem_commit_addr = mem_start_brk;          /* nothing committed yet */
+    mem_max_addr = mem_start_brk + max_heap;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
 }
 
@@ -39,7 +88,7 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    munmap(mem_reserve, mem_reserve_size);
 }
 
 /*
@@ -48,26 +97,213 @@ void mem_deinit(void)
 void mem_reset_brk()
 {
     mem_brk = mem_start_brk;
+
+    /* Regions outside the heap go away with it */
+    while (mem_mappings != NULL)
+	mem_unmap((char *)mem_mappings + sizeof(mapping_t));
+}
+
+/*
+ * mem_map - map a region of at least size bytes outside the heap and
+ *    return the address of its first byte, or NULL on error
+ */
+void *mem_map(size_t size)
+{
+    size_t pagesize = mem_pagesize();
+    mapping_t *m;
+
+    if (size > (size_t)-1 - sizeof(mapping_t) - pagesize) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    size = (size + sizeof(mapping_t) + pagesize-1) & ~(pagesize-1);
+    m = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED)
+	return NULL;
+
+    m->size = size;
+    m->prev = NULL;
+    m->next = mem_mappings;
+    if (mem_mappings != NULL)
+	mem_mappings->prev = m;
+    mem_mappings = m;
+    mem_mapped += size;
+    return (char *)m + sizeof(mapping_t);
+}
+
+/*
+ * mem_remap - resize region p from mem_map to at least size bytes,
+ *    moving it if need be. Returns the new address, or NULL on error
+ *    with p untouched.
+ */
+void *mem_remap(void *p, size_t size)
+{
+    size_t pagesize = mem_pagesize();
+    mapping_t *m = (mapping_t *)((char *)p - sizeof(mapping_t));
+    mapping_t *new;
+
+    if (size > (size_t)-1 - sizeof(mapping_t) - pagesize) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    size = (size + sizeof(mapping_t) + pagesize-1) & ~(pagesize-1);
+    new = mremap(m, m->size, size, MREMAP_MAYMOVE);
+    if (new == MAP_FAILED)
+	return NULL;
+
+    mem_mapped += size - new->size;
+    new->size = size;
+    if (new->prev != NULL)
+	new->prev->next = new;
+    else
+	mem_mappings = new;
+    if (new->next != NULL)
+	new->next->prev = new;
+    return (char *)new + sizeof(mapping_t);
+}
+
+/*
+ * mem_unmap - give region p from mem_map back to the kernel
+ */
+void mem_unmap(void *p)
+{
+    mapping_t *m = (mapping_t *)((char *)p - sizeof(mapping_t));
+
+    if (m->prev != NULL)
+	m->prev->next = m->next;
+    else
+	mem_mappings = m->next;
+    if (m->next != NULL)
+	m->next->prev = m->prev;
+    mem_mapped -= m->size;
+    munmap(m, m->size);
+}
+
+/*
+ * mem_mapsize - return the number of usable bytes in region p from
+ *    mem_map
+ */
+size_t mem_mapsize(void *p)
+{
+    return ((mapping_t *)((char *)p - sizeof(mapping_t)))->size - 
+	sizeof(mapping_t);
+}
+
+/*
+ * mem_mapped_bytes - return the total size of the regions from mem_map
+ */
+size_t mem_mapped_bytes(void)
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_is_mapped - return 1 if the bytes lo through hi lie inside one
+ *    region from mem_map, 0 otherwise
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    mapping_t *m;
+
+    for (m = mem_mappings; m != NULL; m = m->next)
+	if ((char *)lo >= (char *)m + sizeof(mapping_t) &&
+	    (char *)hi < (char *)m + m->size)
+	    return 1;
+    return 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area.
+ *    A negative incr shrinks the heap and gives the pages past the
+ *    new brk back to the kernel.
  */
 void *mem_sbrk(int incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if (incr < 0 && -(long)incr > mem_brk - mem_start_brk) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Shrank below the heap start...\n");
+	return (void *)-1;
+    }
+    if (incr > mem_max_addr - mem_brk || 
+	((mem_brk + incr) > mem_commit_addr && mem_commit(mem_brk + incr) < 0)) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
     mem_brk += incr;
+    if (incr < 0)
+	mem_release(mem_brk, old_brk - mem_brk);
     return (void *)old_brk;
 }
 
+/*
+ * mem_commit - make the pages up to addr readable and writable, a
+ *    commit granule at a time. Returns 0 on success, -1 on error.
+ */
+static int mem_commit(char *addr)
+{
+    char *end = (char *)(((size_t)addr + mem_commit_size-1) & 
+			 ~(mem_commit_size-1));
+
+    if (end > mem_max_addr)
+	end = mem_max_addr;
+    if (mprotect(mem_commit_addr, end - mem_commit_addr, 
+		 PROT_READ | PROT_WRITE) < 0)
+	return -1;
+    mem_commit_addr = end;
+    return 0;
+}
+
+/*
+ * mem_release - give the whole pages inside the len bytes at lo back
+ *    to the kernel. They read as zero the next time they are touched.
+ *    Returns the number of bytes released.
+ */
+size_t mem_release(void *lo, size_t len)
+{
+    size_t pagesize = mem_pagesize();
+    char *start = (char *)(((size_t)lo + pagesize-1) & ~(pagesize-1));
+    char *end = (char *)(((size_t)lo + len) & ~(pagesize-1));
+
+    if (end <= start)
+	return 0;
+    if (madvise(start, end - start, MADV_DONTNEED) < 0)
+	return 0;
+    return end - start;
+}
+
+/*
+ * mem_resident - return the number of heap bytes backed by resident
+ *    pages
+ */
+size_t mem_resident(void)
+{
+    static unsigned char *vec;
+    static size_t maxpages;       /* pages vec has room for */
+    size_t pagesize = mem_pagesize();
+    size_t npages = (mem_brk - mem_start_brk + pagesize-1) / pagesize;
+    size_t i, resident = 0;
+    unsigned char *bigger;
+
+    if (npages == 0)
+	return 0;
+    if (npages > maxpages) {
+	if ((bigger = realloc(vec, npages)) == NULL)
+	    return 0;
+	vec = bigger;
+	maxpages = npages;
+    }
+    if (mincore(mem_start_brk, npages * pagesize, vec) < 0)
+	return 0;
+    for (i = 0; i < npages; i++)
+	resident += vec[i] & 1;
+    return resident * pagesize;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -92,6 +328,14 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_maxsize() - returns the largest size the heap can grow to
+ */
+size_t mem_maxsize()
+{
+    return (size_t)(mem_max_addr - mem_start_brk);
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -1,11 +1,21 @@
 #include <unistd.h>
 
 void mem_init(void);               
+void mem_init_size(size_t max_heap, int hugepages);
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+size_t mem_release(void *lo, size_t len);
+size_t mem_resident(void);
 void mem_reset_brk(void); 
+void *mem_map(size_t size);
+void *mem_remap(void *p, size_t size);
+void mem_unmap(void *p);
+size_t mem_mapsize(void *p);
+size_t mem_mapped_bytes(void);
+int mem_is_mapped(void *lo, void *hi);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_maxsize(void);
 size_t mem_pagesize(void);
 
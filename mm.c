@@ -1,55 +1,126 @@
 /* 
- * Simple allocator based on implicit free lists with boundary 
- * tag coalescing. Each block has header and footer of the form:
+ * Allocator based on a size-keyed red-black tree of free blocks with
+ * boundary tag coalescing. Each block has a header word of the form:
  * 
- *      31                     3  2  1  0 
+ *      63/31                  3  2  1  0 
  *      -----------------------------------
- *     | s  s  s  s  ... s  s  s  0  0  a/f
+ *     | s  s  s  s  ... s  s  s  c  p  a/f
  *      ----------------------------------- 
  * 
- * where s are the meaningful size bits and a/f is set 
- * iff the block is allocated. The list has the following form:
+ * where s are the meaningful size bits, a/f is set iff the block is
+ * allocated, p is set iff the previous block is allocated and c is the
+ * tree node color of a free block. In an allocated block c is set iff
+ * the block lives in a mapping of its own outside the heap, which is
+ * where requests of MMAPTHRESHOLD bytes and up go. Only free blocks
+ * repeat their size in a footer word, which is all coalesce needs to
+ * find a free previous block; allocated blocks pay for their header
+ * alone.
+ * Words are as wide as a pointer: 4 bytes with doubleword (8-byte)
+ * payload alignment in a 32-bit build, 8 bytes with 16-byte alignment
+ * in a 64-bit build. A free block stores its LEFT, RIGHT, PARENT and
+ * NEXT (same-size chain) links in the first 16 payload bytes as 32-bit
+ * offsets from the start of the heap, so the minimum block is 24 bytes
+ * in a 32-bit build and 32 bytes in a 64-bit one. The heap has the
+ * following form:
  *
  * begin                                                          end
  * heap                                                           heap  
  *  -----------------------------------------------------------------   
- * |  pad   | hdr(8:a) | ftr(8:a) | zero or more usr blks | hdr(8:a) |
+ * |  pad   | hdr(D:a) | ftr(D:a) | zero or more usr blks | hdr(0:a) |
  *  -----------------------------------------------------------------
  *          |       prologue      |                       | epilogue |
  *          |         block       |                       | block    |
  *
  * The allocated prologue and epilogue blocks are overhead that
  * eliminate edge conditions during coalescing.
+ *
+ * The package is thread safe. Each thread is bound to one of NUMARENAS
+ * arenas, and every arena owns one or more such segments of the
+ * mem_sbrk region. The padding word of a segment links it to the
+ * arena's previous segment. Small blocks freed by a thread go to a
+ * per-thread cache first, and blocks freed by a thread bound to another
+ * arena are handed back to their owner through a lock-free remote list.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
 
 team_t team = {"jepsin11mdemali","James Espinosa", "jespin11","Matt Demali","mdemali"}; /* so we're compatible with 15213 driver */
 
 /* $begin mallocmacros */
 /* Basic constants and macros */
+#ifdef __LP64__
+#define WSIZE       8       /* word size (bytes) */  
+#define DSIZE       16      /* doubleword size (bytes) */
+#else
 #define WSIZE       4       /* word size (bytes) */  
 #define DSIZE       8       /* doubleword size (bytes) */
+#endif
 #define CHUNKSIZE  (1<<12)   /* initial heap size (bytes) */
-#define OVERHEAD    8       /* overhead of header and footer (bytes) */
+#define OVERHEAD    WSIZE   /* overhead of an allocated block's header (bytes) */
 
 #define MAX(x, y) ((x) > (y)? (x) : (y))
+#define MIN(x, y) ((x) < (y)? (x) : (y))
 
 /* Additional constants and macros */
-#define PADDING    4
-#define PROLOGSIZE 16
-#define EPILOGSIZE 8
-#define RIGHT(bp) ((void *)* (int *)(bp+WSIZE))
-#define LEFT(bp) ((void *)* (int *)(bp))
-#define SETLEFT(bp, bq) (*(int *)(bp)) = (int)(bq)
-#define ADJUSTSIZE(size) ((((size) + DSIZE + 7) / DSIZE ) * DSIZE)
-#define SETRIGHT(bp, bq) (*(int *)(bp+WSIZE)) = (int)(bq)
-#define GETSIZE(bp) ((*(int*) (bp-WSIZE)) & ~7)
+#define PADDING    WSIZE
+#define PROLOGSIZE (2*DSIZE)
+#define EPILOGSIZE WSIZE
+#define TREEWORDS  4       /* left, right, parent, next links of a free block */
+#define LINKSIZE   4       /* a link is a 32-bit heap offset */
+#define MINBLOCKSIZE (DSIZE * ((TREEWORDS*LINKSIZE + DSIZE + DSIZE-1) / DSIZE))
+
+/* Convert between block pointers and heap offsets; offset 0 is NULL */
+#define TOPTR(off) ((off) ? (void *)(heap_lo + (off)) : NULL)
+#define TOOFF(bp) ((bp) ? (unsigned int)((char *)(bp) - heap_lo) : 0)
+#define LINK(bp, i) (*(unsigned int *)((char *)(bp) + (i)*LINKSIZE))
+
+#define LEFT(bp) TOPTR(LINK(bp, 0))
+#define RIGHT(bp) TOPTR(LINK(bp, 1))
+#define PARENT(bp) TOPTR(LINK(bp, 2))
+#define NEXT(bp) TOPTR(LINK(bp, 3))
+#define PREV(bp) LEFT(bp)   /* chained blocks reuse LEFT as a back pointer */
+#define CHAINPREV(bp) ((void *)(heap_lo + LINK(bp, 0))) /* PREV, never NULL */
+#define SETLEFT(bp, bq) (LINK(bp, 0) = TOOFF(bq))
+#define SETRIGHT(bp, bq) (LINK(bp, 1) = TOOFF(bq))
+#define SETPARENT(bp, bq) (LINK(bp, 2) = TOOFF(bq))
+#define SETNEXT(bp, bq) (LINK(bp, 3) = TOOFF(bq))
+#define SETPREV(bp, bq) SETLEFT(bp, bq)
+#define ADJUSTSIZE(size) MAX((((size) + OVERHEAD + DSIZE-1) / DSIZE ) * DSIZE, MINBLOCKSIZE)
+#define GETSIZE(bp) GET_SIZE(HDRP(bp))
+
+/* Red-Black Tree node color, kept in bit 2 of a free block's header */
+#define RED 0x4
+#define IS_RED(bp) ((bp) != NULL && (GET(HDRP(bp)) & RED))
+#define SET_RED(bp) PUT(HDRP(bp), GET(HDRP(bp)) | RED)
+#define SET_BLACK(bp) PUT(HDRP(bp), GET(HDRP(bp)) & ~RED)
+#define COPY_COLOR(bp, bq) PUT(HDRP(bp), (GET(HDRP(bp)) & ~RED) | (GET(HDRP(bq)) & RED))
+
+/* 
+ * An allocated block in its own mapping is tagged with bit 2 instead.
+ * Its block pointer is DSIZE bytes past MAPFRONT bytes into the
+ * mapping, a number kept in the word below its header and nonzero only
+ * for mm_memalign, and its header holds the usable size from there on.
+ */
+#define MMAPPED 0x4
+#define IS_MMAPPED(bp) (GET(HDRP(bp)) & MMAPPED)
+#define MAPFRONT(bp) (*(size_t *)((char *)(bp) - DSIZE))
 
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc)  ((size) | (alloc))
 
+/* Allocation state of the previous block, kept in bit 1 of each header */
+#define PREVALLOC 0x2
+#define GET_PREVALLOC(p) (GET(p) & PREVALLOC)
+#define SET_PREVALLOC(bp) PUT(HDRP(bp), GET(HDRP(bp)) | PREVALLOC)
+#define CLR_PREVALLOC(bp) PUT(HDRP(bp), GET(HDRP(bp)) & ~PREVALLOC)
+
 /* Read and write a word at address p */
 #define GET(p)       (*(size_t *)(p))
 #define PUT(p, val)  (*(size_t *)(p) = (val))  //store val where p is pointing to
@@ -58,66 +129,354 @@ team_t team = {"jepsin11mdemali","James Espinosa", "jespin11","Matt Demali","mde
 #define GET_SIZE(p)  (GET(p) & ~0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
 
-/* Given block ptr bp, compute address of its header and footer */
+/* Given block ptr bp, compute address of its header and (free only) footer */
 #define HDRP(bp)       ((char *)(bp) - WSIZE)  
 #define FTRP(bp)       ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 
-/* Given block ptr bp, compute address of next and previous blocks */
+/* Given block ptr bp, compute address of next and (free only) previous blocks */
 #define NEXT_BLKP(bp)  ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
 #define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 /* $end mallocmacros */
 
-/* The only global variable is a pointer to the first block */
-static char *heap_listp;
-static void *tree_root;
+/* Segregated size classes, one exact-size free list per DSIZE step */
+#ifndef SEGLIMIT
+#define SEGLIMIT   512      /* largest block size served by a size class */
+#endif
+#define NUMCLASSES ((SEGLIMIT - MINBLOCKSIZE) / DSIZE + 1)
+#define CLASS(asize) (((asize) - MINBLOCKSIZE) / DSIZE)
+
+#if NUMCLASSES > 64
+#error "SEGLIMIT has more size classes than seg_map can track"
+#endif
+#if SEGLIMIT < MM_FIXEDLIMIT
+#error "mm_malloc_fixed needs a size class for every block up to MM_FIXEDLIMIT"
+#endif
+
+/* mm.h computes the classes of mm_malloc_fixed with this same layout */
+typedef char fixed_layout_check[(MM_DSIZE == DSIZE && 
+                                 MM_MINBLOCK == MINBLOCKSIZE) ? 1 : -1];
+
+/* Arenas and per-thread caches */
+#ifndef NUMARENAS
+#define NUMARENAS  8        /* number of independently locked arenas */
+#endif
+#ifndef TCACHELIMIT
+#define TCACHELIMIT 256     /* largest block size kept in a thread cache */
+#endif
+#ifndef TCACHECOUNT
+#define TCACHECOUNT 7       /* blocks kept per size class in a thread cache */
+#endif
+#define TCACHECLASSES (CLASS(TCACHELIMIT) + 1)
+#define GRAINSHIFT 12       /* arena ownership is tracked per 4KB grain */
+#define GRAIN      (1<<GRAINSHIFT)
+
+/* A batch is carved from free blocks of at most this many bytes each */
+#ifndef CARVELIMIT
+#define CARVELIMIT (1<<20)
+#endif
+
+/* Largest heap extension: mem_sbrk takes an int, padding included */
+#define MAXEXTEND  ((size_t)INT_MAX - 3*GRAIN)
+
+/* Free blocks this large give their memory back to the system */
+#ifndef TRIMTHRESHOLD
+#define TRIMTHRESHOLD (128*1024)
+#endif
+
+/* 
+ * Set QUICKLIST to n > 0 to defer coalescing: each arena keeps up to n
+ * freed blocks, still marked allocated, for exact size reuse and
+ * coalesces them all at once when the list overflows or misses
+ */
+#ifndef QUICKLIST
+#define QUICKLIST 0
+#endif
+
+/* 
+ * Set ADDRORDER to 1 for locality aware placement: free blocks of equal
+ * size, in the size class lists and in the tree's chains, are kept in
+ * address order. A tree fit is taken from the block of the best fitting
+ * size nearest a hint, which defaults to the arena's latest allocation,
+ * and split on the side facing it; a size class fit is taken nearest
+ * the hint of mm_malloc_near, or from the lowest address. Inserting a
+ * block and finding the nearest one walk its list, so each walk stops
+ * after ADDRSCAN blocks and a longer list is only ordered that far in
+ * (0 walks the whole list and keeps it strictly ordered).
+ */
+#ifndef ADDRORDER
+#define ADDRORDER 0
+#endif
+#ifndef ADDRSCAN
+#define ADDRSCAN 64
+#endif
+
+/* 
+ * Set CHECKEVERY to n > 0 for canary builds: every n-th call of a
+ * thread that allocates, frees or resizes (mm_malloc, mm_free,
+ * mm_realloc and their batch, class, hinted and aligned forms) checks
+ * the next CHECKSLICE blocks of its arena, picking up where the
+ * previous slice stopped, and aborts on corruption
+ */
+#ifndef CHECKEVERY
+#define CHECKEVERY 0
+#endif
+#ifndef CHECKSLICE
+#define CHECKSLICE 64
+#endif
+
+/* Regions bump allocate from blocks of this many bytes */
+#ifndef REGIONCHUNK
+#define REGIONCHUNK (16*1024)
+#endif
+
+/* Requests this large get a mapping of their own outside the heap */
+#ifndef MMAPTHRESHOLD
+#define MMAPTHRESHOLD (32*1024)
+#endif
+
+/* Larger requests fail, so sizes plus any overhead never wrap around */
+#define MAXREQUEST ((size_t)PTRDIFF_MAX)
+
+#if TCACHELIMIT > SEGLIMIT
+#error "TCACHELIMIT must not exceed SEGLIMIT"
+#endif
+
+#if REGIONCHUNK >= MMAPTHRESHOLD
+#error "REGIONCHUNK must stay below MMAPTHRESHOLD"
+#endif
+
+/* 
+ * A region is a list of ordinary allocated blocks, its chunks, linked
+ * through their first word. Allocations are bumped off the latest chunk
+ * with no header of their own; ones too large to share a chunk get a
+ * chunk to themselves. The region's own bookkeeping sits in its first
+ * chunk. The chunks come from the arena like any block, so they are not
+ * one contiguous span, and destroying a region takes a free per chunk
+ * rather than constant time.
+ */
+struct mm_region {
+    char *chunks;                  /* latest chunk, NULL-terminated list */
+    char *bump;                    /* next free byte of the current chunk */
+    char *end;                     /* end of the current chunk */
+};
+
+/* Keep the incremental checker off blocks that merge into others */
+#if CHECKEVERY
+#define CHECK_MERGED(a, bp, into) \
+    if ((a)->check_bp == (char *)(bp)) (a)->check_bp = (char *)(into)
+#else
+#define CHECK_MERGED(a, bp, into)
+#endif
+
+#define CHUNKLINK(c) (*(char **)(c))
+#define REGIONBIG  (REGIONCHUNK / 4) /* requests that get their own chunk */
+
+/* Segments of an arena are linked through their alignment padding word */
+#define SEGLINK(seg) (*(char **)(seg))
+#define SETSEGLINK(seg, sq) (*(char **)(seg) = (sq))
+
+/* 
+ * An arena is an independent heap: its own segments of the mem_sbrk
+ * region, its own free tree and size class lists, and its own lock.
+ * Blocks freed by a thread that is not bound to the owning arena are
+ * pushed on the arena's lock-free remote list, linked through NEXT,
+ * and freed by the owner the next time it takes the lock. Once every
+ * thread bound to an arena has exited, nobody would, so frees take its
+ * lock and free into it directly until a new thread is bound to it.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    char *heap_listp;              /* prologue of the first segment */
+    char *last_seg;                /* most recent segment, NULL if none */
+    char *epilogue;                /* epilogue header of last_seg */
+    void *tree_root;               /* free tree */
+    void *seg_lists[NUMCLASSES];   /* size class lists ... */
+    unsigned long long seg_map;    /* ... and the bitmap of non-empty ones */
+    void *volatile remote;         /* blocks freed by other threads */
+    volatile int threads;          /* live threads bound to the arena */
+    long seg_hits[NUMCLASSES];
+    long seg_misses[NUMCLASSES];
+    size_t avg_size;               /* running average of placed sizes */
+    void *last_realloc;            /* block of the latest realloc */
+#if ADDRORDER
+    void *last_alloc;              /* block of the latest allocation */
+    void *hint;                    /* placement hint of mm_malloc_near */
+#endif
+#if QUICKLIST
+    void *quick[QUICKLIST];        /* frees awaiting coalescing */
+    int quick_count;
+#endif
+#if CHECKEVERY
+    char *check_seg;               /* segment of check_bp */
+    char *check_bp;                /* block the next check slice starts at */
+#endif
+    mm_stats_t stats;              /* event counters for mm_stats */
+} arena_t;
+
+/*
+ * A thread cache holds up to TCACHECOUNT freed blocks per small size
+ * class of the thread's arena. Cached blocks stay marked allocated and
+ * are linked through their first payload word, so pushing and popping
+ * takes no lock. A cache filled before the last mm_init is stale.
+ */
+typedef struct {
+    unsigned generation;
+    arena_t *arena;
+    void *bins[TCACHECLASSES];
+    int counts[TCACHECLASSES];
+} tcache_t;
+
+static arena_t arenas[NUMARENAS];
+static char *heap_lo;                        /* base of the link offsets */
+static unsigned char *arena_owner;           /* arena index of each grain */
+static size_t num_grains;                    /* grains in the largest heap */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER; /* mem_sbrk */
+static unsigned generation;                  /* bumped by every mm_init */
+static unsigned next_arena;                  /* threads bound so far */
+static long mmaps, remaps;                   /* mem_map and mem_remap calls */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+static __thread arena_t *thread_arena;
+static __thread unsigned thread_generation;  /* mm_init it was bound after */
+static __thread tcache_t tcache;
+#if CHECKEVERY
+static __thread unsigned check_ops;          /* mm calls, for check_tick */
+#endif
 
 /* function prototypes for internal helper routines */
-static void *extend_heap(size_t words);
-static void *place(void *bp, size_t asize);
-static void *find_fit(size_t asize);
-static void *coalesce(void *bp);
+static void *extend_heap(arena_t *a, size_t words);
+static void *new_segment(arena_t *a, size_t size);
+static void *place(arena_t *a, void *bp, size_t asize);
+static void *coalesce(arena_t *a, void *bp);
 static void printblock(void *bp); 
-static void checkblock(void *bp);
+static int checkblock(arena_t *a, void *bp);
+static int check_free(arena_t *a, void *bp);
+static int check_tree(void *h, void *parent, size_t lo, size_t hi,
+                      long *count, int *errors);
+static int heap_error(void *bp, char *what);
+#if CHECKEVERY
+static void check_tick(void);
+static void check_slice(arena_t *a, int n);
+#endif
+static void free_insert(arena_t *a, void *bp);
+static void free_remove(arena_t *a, void *bp);
+static void *seg_alloc(arena_t *a, size_t asize);
+static void seg_insert(arena_t *a, void *bp);
+static void seg_remove(arena_t *a, void *bp);
+static void *arena_malloc(arena_t *a, size_t asize);
+static void arena_free(arena_t *a, void *bp);
+static void *arena_realloc(arena_t *a, void *ptr, size_t size);
+static int arena_carve(arena_t *a, size_t asize, int n, void **ptrs);
+static void sort_blocks(void **ptrs, int n);
+static void realloc_fit(arena_t *a, void *bp, size_t csize, size_t asize);
+static void arena_drain(arena_t *a);
+#if QUICKLIST
+static void quick_flush(arena_t *a);
+#endif
+static void *arena_trim(arena_t *a, void *bp, void *freed, size_t len);
+static arena_t *arena_of(void *bp);
+static arena_t *arena_get(void);
+static tcache_t *tcache_get(void);
+static void tcache_flush(void *arg);
+static void tcache_key_init(void);
+static size_t adjust_size(size_t size);
+static void *mmap_malloc(size_t size);
+static void *mmap_memalign(size_t align, size_t size);
+static void mmap_free(void *bp);
+static void *mmap_realloc(void *ptr, size_t size);
+static int tree_depth(void *h);
+#if ADDRORDER
+static void *near_target(arena_t *a);
+#endif
 
 /* Additional function declarations */
 void *mm_insert(void *root, void *bp);
 void *mm_remove(void *root, void *bp);
-void *mm_ceiling(void *root,  int size);
-void *mm_parent(void *root, void *bp);
-void *mm_replace(void *bp);
-void *mm_remove_node(void *root, void *bp);
-void *mm_remove_child(void *root, void *bp);
-void *mm_remove_children(void *root, void *bp);
-
-int mm_children(void *root);
+void *mm_ceiling(void *root, size_t size, long *visits);
+void *mm_nearest(void *h, void *near);
+void *mm_replace(void *root, void *h, void *bp);
+void *mm_min(void *h);
+void *mm_insert_fixup(void *root, void *bp);
+void *mm_remove_fixup(void *root, void *bp, void *parent);
+void *mm_transplant(void *root, void *bp, void *child);
+void *mm_rotate_left(void *root, void *h);
+void *mm_rotate_right(void *root, void *h);
 
 /* 
- * mm_init - Initialize the memory manager 
+ * mm_init - Initialize the memory manager. Must not run concurrently
+ *     with any other mm_ call.
  */
 /* $begin mminit */
 int mm_init(void) 
 {
+    arena_t *a = &arenas[0];
+    char *heap_listp;
     void *bp;
+    size_t grains;
+    int i;
+
+    pthread_once(&tcache_once, tcache_key_init);
+
+    /* Links are 32-bit heap offsets, so the heap must stay below 4GB */
+    if (mem_maxsize() > 0xffffffffUL)
+        return -1;
+
+    /* Size the owner table for the largest heap memlib can hand out */
+    grains = (mem_maxsize() + GRAIN-1) >> GRAINSHIFT;
+    if (grains != num_grains) {
+        if (arena_owner != NULL)
+            munmap(arena_owner, num_grains);
+        arena_owner = mmap(NULL, grains, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        num_grains = grains;
+        if (arena_owner == MAP_FAILED) {
+            arena_owner = NULL;
+            num_grains = 0;
+            return -1;
+        }
+    }
 
-    tree_root = NULL;
+    /* Forget every arena and invalidate all thread caches */
+    for (i = 0; i < NUMARENAS; i++) {
+        pthread_mutex_t lock = arenas[i].lock;
 
-    /* Create the initial empty heap */
-    if ((heap_listp = mem_sbrk(PROLOGSIZE)) == NULL)
+        memset(&arenas[i], 0, sizeof(arena_t));
+        arenas[i].lock = lock;
+        if (!generation)
+            pthread_mutex_init(&arenas[i].lock, NULL);
+    }
+    memset(arena_owner, 0, num_grains);
+    mmaps = remaps = 0;
+    generation++;
+
+    /* The caller starts over as the only thread, bound to arena 0 */
+    thread_arena = a;
+    thread_generation = generation;
+    a->threads = 1;
+    pthread_setspecific(tcache_key, &tcache);
+    next_arena = 1;
+
+    /* Create the initial empty heap, owned by arena 0 */
+    heap_lo = mem_heap_lo();
+    if ((heap_listp = mem_sbrk(PROLOGSIZE)) == (void *)-1)
         return -1;
 
     PUT(heap_listp, 0);                        /* alignment padding */
-    PUT(heap_listp+WSIZE, PACK(OVERHEAD, 1));  /* prologue header */ 
-    PUT(heap_listp+DSIZE, PACK(OVERHEAD, 1));  /* prologue footer */ 
-    PUT(heap_listp+WSIZE+DSIZE, PACK(0, 1));   /* epilogue header */
-    heap_listp += DSIZE;
+    PUT(heap_listp+WSIZE, PACK(DSIZE, 1|PREVALLOC)); /* prologue header */ 
+    PUT(heap_listp+DSIZE, PACK(DSIZE, 1));           /* prologue footer */ 
+    PUT(heap_listp+WSIZE+DSIZE, PACK(0, 1|PREVALLOC)); /* epilogue header */
+    a->last_seg = heap_listp;
+    a->epilogue = heap_listp + WSIZE + DSIZE;
+    a->heap_listp = heap_listp + DSIZE;
 
     /* Extend the empty heap with a free block of CHUNKSIZE bytes */
-    bp = extend_heap(CHUNKSIZE/WSIZE);
+    bp = extend_heap(a, CHUNKSIZE/WSIZE);
 
     if (bp == NULL)
         return -1;
 
-    tree_root = mm_insert(tree_root, bp);
+    free_insert(a, bp);
 
     return 0;
 }
@@ -130,39 +489,178 @@ int mm_init(void)
 void *mm_malloc(size_t size) 
 {
     size_t asize;      /* adjusted block size */
-    size_t extendsize; /* amount to extend heap if no fit */
+    arena_t *a;
+    tcache_t *tc;
     char *bp;
 
+#if CHECKEVERY
+    check_tick();
+#endif
+
     /* Ignore spurious requests */
     if (size <= 0)
         return NULL;
 
-    /* Adjust block size to include overhead and alignment reqs. */
-    if (size <= DSIZE)
-        asize = DSIZE + OVERHEAD;
-    else
-        asize = DSIZE * ((size + (OVERHEAD) + (DSIZE-1)) / DSIZE);
-    
-    /* Search the free list for a fit */
-    if ((bp = mm_ceiling(tree_root,asize)) != NULL) 
-    {
-        tree_root = mm_remove(tree_root,bp);
-        bp = place(bp, asize);
-        return bp;
-    }
+    if (size >= MMAPTHRESHOLD)
+        return mmap_malloc(size);
 
-    /* No fit found. Get more memory and place the block */
-    extendsize = MAX(asize,CHUNKSIZE);
+    asize = adjust_size(size);
 
-    if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
-        return NULL;
+    /* Small sizes are served from the thread cache without locking */
+    if (asize <= TCACHELIMIT && next_arena > 1) {
+        tc = tcache_get();
+        if ((bp = tc->bins[CLASS(asize)]) != NULL) {
+            tc->bins[CLASS(asize)] = LEFT(bp);
+            tc->counts[CLASS(asize)]--;
+            return bp;
+        }
+    }
 
-    bp = place(bp, asize);
+    a = arena_get();
+    pthread_mutex_lock(&a->lock);
+    arena_drain(a);
+    bp = arena_malloc(a, asize);
+    pthread_mutex_unlock(&a->lock);
 
     return bp;
 } 
 /* $end mmmalloc */
 
+/*
+ * mm_malloc_class - Allocate a block of size class cls, as computed at
+ *     compile time by mm_malloc_fixed. An exact hit in the thread cache
+ *     or the class's free list is taken without touching anything else;
+ *     only a miss goes through arena_malloc.
+ */
+void *mm_malloc_class(int cls)
+{
+    size_t asize = MINBLOCKSIZE + (size_t)cls * DSIZE;
+    arena_t *a;
+    tcache_t *tc;
+    char *bp;
+
+#if CHECKEVERY
+    check_tick();
+#endif
+
+    if (cls < TCACHECLASSES && next_arena > 1) {
+        tc = tcache_get();
+        if ((bp = tc->bins[cls]) != NULL) {
+            tc->bins[cls] = LEFT(bp);
+            tc->counts[cls]--;
+            return bp;
+        }
+    }
+
+    a = arena_get();
+    pthread_mutex_lock(&a->lock);
+    arena_drain(a);
+    if ((bp = a->seg_lists[cls]) != NULL) {
+        a->seg_hits[cls]++;
+        seg_remove(a, bp);
+        PUT(HDRP(bp), PACK(asize, 1|PREVALLOC));
+        SET_PREVALLOC(NEXT_BLKP(bp));
+#if ADDRORDER
+        a->last_alloc = bp;
+#endif
+    } else
+        bp = arena_malloc(a, asize);
+    pthread_mutex_unlock(&a->lock);
+
+    return bp;
+}
+
+/*
+ * mm_malloc_near - Allocate like mm_malloc, preferring free memory close
+ *     to hint. Only built with ADDRORDER does the hint steer placement,
+ *     and only for requests below MMAPTHRESHOLD: small ones take the
+ *     nearest of the first ADDRSCAN blocks of their size class, larger
+ *     ones the nearest block of the best fitting tree size. The thread
+ *     cache is skipped, since it knows nothing of addresses.
+ */
+void *mm_malloc_near(size_t size, void *hint)
+{
+#if ADDRORDER
+    arena_t *a;
+    char *bp;
+
+    if (size <= 0 || size >= MMAPTHRESHOLD || hint == NULL)
+        return mm_malloc(size);
+
+#if CHECKEVERY
+    check_tick();
+#endif
+    a = arena_get();
+    pthread_mutex_lock(&a->lock);
+    arena_drain(a);
+    a->hint = hint;
+    bp = arena_malloc(a, adjust_size(size));
+    a->hint = NULL;
+    pthread_mutex_unlock(&a->lock);
+
+    return bp;
+#else
+    return mm_malloc(size);
+#endif
+}
+
+/*
+ * mm_memalign - Allocate a block with at least size bytes of payload
+ *     at a multiple of align, a power of two. A block with room for the
+ *     payload, the alignment and a free block in front is split three
+ *     ways, and the space before and after the payload is freed. Sizes
+ *     or alignments from MMAPTHRESHOLD up get an aligned mapping.
+ */
+void *mm_memalign(size_t align, size_t size)
+{
+    size_t asize, csize, front;
+    arena_t *a;
+    char *bp, *aligned;
+
+    if (align <= DSIZE)
+        return mm_malloc(size);
+    if (size <= 0 || size > MAXREQUEST || align > MAXREQUEST - size)
+        return NULL;
+#if CHECKEVERY
+    check_tick();
+#endif
+
+    if (size >= MMAPTHRESHOLD || align >= MMAPTHRESHOLD)
+        return mmap_memalign(align, size);
+
+    asize = adjust_size(size);
+    a = arena_get();
+    pthread_mutex_lock(&a->lock);
+    arena_drain(a);
+    if ((bp = arena_malloc(a, asize + align + MINBLOCKSIZE)) != NULL) {
+        csize = GETSIZE(bp);
+        if ((size_t)bp % align) {
+            aligned = (char *)(((size_t)bp + MINBLOCKSIZE + align-1) & ~(align-1));
+            front = aligned - bp;
+            PUT(HDRP(aligned), PACK(csize - front, 1));
+            PUT(HDRP(bp), PACK(front, GET_PREVALLOC(HDRP(bp))));
+            PUT(FTRP(bp), PACK(front, 0));
+            free_insert(a, coalesce(a, bp));
+            bp = aligned;
+            csize -= front;
+        }
+        realloc_fit(a, bp, csize, asize);
+    }
+    pthread_mutex_unlock(&a->lock);
+
+    return bp;
+}
+
+/*
+ * mm_usable_size - Number of payload bytes block bp can hold
+ */
+size_t mm_usable_size(void *bp)
+{
+    if (IS_MMAPPED(bp))
+        return GETSIZE(bp) - DSIZE;
+    return GETSIZE(bp) - OVERHEAD;
+}
+
 /* 
  * mm_free - Free a block 
  */
@@ -170,150 +668,1120 @@ void *mm_malloc(size_t size)
 void mm_free(void *bp)
 {
     size_t size = GET_SIZE(HDRP(bp));
+    arena_t *a;
+    tcache_t *tc;
+    void *head;
 
-    PUT(HDRP(bp), PACK(size, 0));
-    PUT(FTRP(bp), PACK(size, 0));
+#if CHECKEVERY
+    check_tick();
+#endif
+
+    if (IS_MMAPPED(bp)) {
+        mmap_free(bp);
+        return;
+    }
+    a = arena_of(bp);
+
+    /* 
+     * Blocks of another arena go back through its remote list, unless
+     * no thread is left to drain it. The last one to exit may have
+     * drained it just before the push, so the count is read again.
+     */
+    if (a != arena_get()) {
+        if (a->threads == 0) {
+            pthread_mutex_lock(&a->lock);
+            arena_drain(a);
+            arena_free(a, bp);
+            pthread_mutex_unlock(&a->lock);
+            return;
+        }
+        do {
+            head = a->remote;
+            SETNEXT(bp, head);
+        } while (!__sync_bool_compare_and_swap(&a->remote, head, bp));
+        if (a->threads == 0) {
+            pthread_mutex_lock(&a->lock);
+            arena_drain(a);
+            pthread_mutex_unlock(&a->lock);
+        }
+        return;
+    }
 
-    tree_root = mm_insert(tree_root,coalesce(bp));
+    /* 
+     * Small blocks of our own arena stay in the thread cache. A single
+     * threaded process takes its uncontended lock instead, so freed
+     * blocks coalesce right away.
+     */
+    if (size <= TCACHELIMIT && next_arena > 1) {
+        tc = tcache_get();
+        if (tc->counts[CLASS(size)] < TCACHECOUNT) {
+            SETLEFT(bp, tc->bins[CLASS(size)]);
+            tc->bins[CLASS(size)] = bp;
+            tc->counts[CLASS(size)]++;
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&a->lock);
+    arena_drain(a);
+#if QUICKLIST
+    if (a->quick_count == QUICKLIST)
+        quick_flush(a);
+    a->quick[a->quick_count++] = bp;
+#else
+    arena_free(a, bp);
+#endif
+    pthread_mutex_unlock(&a->lock);
 }
 
 /* $end mmfree */
 
-/* Not implemented. For consistency with 15-213 malloc driver */
+/*
+ * mm_realloc - Resize a block in place when its neighbours allow it,
+ *     otherwise move it
+ */
 void *mm_realloc(void *ptr, size_t size)
 {   
+    arena_t *a;
+    void *bp;
+
+#if CHECKEVERY
+    check_tick();
+#endif
 
+    if (IS_MMAPPED(ptr))
+        return mmap_realloc(ptr, size);
+
+    /* Blocks that grow past the threshold move to their own mapping */
+    if (size >= MMAPTHRESHOLD) {
+        size_t copysize = GETSIZE(ptr) - OVERHEAD;
+
+        if ((bp = mmap_malloc(size)) == NULL)
+            return NULL;
+        memcpy(bp, ptr, copysize < size ? copysize : size);
+        mm_free(ptr);
+        return bp;
+    }
+
+    /* Only the owning arena may resize a block in place */
+    a = arena_of(ptr);
+    if (a != arena_get()) {
+        size_t copysize = GETSIZE(ptr) - OVERHEAD;
+
+        if ((bp = mm_malloc(size)) == NULL)
+            return NULL;
+        memcpy(bp, ptr, copysize < size ? copysize : size);
+        mm_free(ptr);
+        __sync_fetch_and_add(&a->stats.realloc_copy, 1);
+        return bp;
+    }
+
+    pthread_mutex_lock(&a->lock);
+    arena_drain(a);
+    bp = arena_realloc(a, ptr, size);
+    pthread_mutex_unlock(&a->lock);
+
+    return bp;
+}
+
+/*
+ * mm_malloc_batch - Allocate n blocks with at least size bytes of
+ *     payload each into ptrs, carving them in runs of up to CARVELIMIT
+ *     bytes from single free blocks. Returns the number of blocks
+ *     allocated, which is less than n only when memory runs out.
+ */
+int mm_malloc_batch(size_t size, int n, void **ptrs)
+{
+    size_t asize;
+    arena_t *a;
+    int i, k;
+
+    if (size <= 0 || n <= 0)
+        return 0;
+
+    /* Mapped blocks gain nothing from carving */
+    if (size >= MMAPTHRESHOLD) {
+        for (i = 0; i < n; i++)
+            if ((ptrs[i] = mm_malloc(size)) == NULL)
+                break;
+        return i;
+    }
+
+#if CHECKEVERY
+    check_tick();
+#endif
+    asize = adjust_size(size);
+    a = arena_get();
+    pthread_mutex_lock(&a->lock);
+    arena_drain(a);
+    for (i = 0; i < n; i += k)
+        if ((k = arena_carve(a, asize, n - i, ptrs + i)) == 0)
+            break;
+    for (; i < n; i++)
+        if ((ptrs[i] = arena_malloc(a, asize)) == NULL)
+            break;
+    pthread_mutex_unlock(&a->lock);
+
+    return i;
+}
+
+/*
+ * mm_free_batch - Free the n blocks in ptrs. The blocks of the
+ *     caller's arena are freed under one lock, and each run of them
+ *     that are neighbours in the heap is coalesced as a single block.
+ *     The order of ptrs is not preserved.
+ */
+void mm_free_batch(void **ptrs, int n)
+{
+    arena_t *a = arena_get();
+    size_t size;
     void *bp;
-    size_t asize = ADJUSTSIZE(size);
+    int i, j, m;
+
+#if CHECKEVERY
+    check_tick();
+#endif
+
+    /* Mapped and foreign blocks take the usual path; keep ours in front */
+    for (i = 0, m = 0; i < n; i++) {
+        bp = ptrs[i];
+        if (IS_MMAPPED(bp) || arena_of(bp) != a) {
+            mm_free(bp);
+            continue;
+        }
+        ptrs[i] = ptrs[m];
+        ptrs[m++] = bp;
+    }
 
-    if(!GETSIZE(NEXT_BLKP(ptr)))
-    {
-        size_t extendsize = MAX(asize, CHUNKSIZE);
-        bp = extend_heap(extendsize/4);
-        size_t nsize = extendsize + GETSIZE(ptr) - asize;
-        
-        PUT(HDRP(ptr), PACK(asize,1));
-        PUT(FTRP(ptr), PACK(asize,1));
+    sort_blocks(ptrs, m);
 
-        void *blk = NEXT_BLKP(ptr);
-        PUT(HDRP(blk), PACK(nsize,0));
-        PUT(FTRP(blk), PACK(nsize, 0));
-        tree_root = mm_insert(tree_root, blk);
-        
-        return ptr;     
+    pthread_mutex_lock(&a->lock);
+    arena_drain(a);
+    for (i = 0; i < m; i = j) {
+        bp = ptrs[i];
+        size = GETSIZE(bp);
+        for (j = i + 1; j < m && ptrs[j] == (char *)bp + size; j++) {
+            CHECK_MERGED(a, ptrs[j], bp);
+            size += GETSIZE(ptrs[j]);
+        }
+
+        PUT(HDRP(bp), PACK(size, GET_PREVALLOC(HDRP(bp))));
+        PUT(FTRP(bp), PACK(size, 0));
+        CLR_PREVALLOC(NEXT_BLKP(bp));
+        free_insert(a, arena_trim(a, coalesce(a, bp), bp, size));
     }
-    
-    if(!(GET_ALLOC(HDRP(NEXT_BLKP(ptr)))))
-    {
-        bp = NEXT_BLKP(ptr);
-        
-        size_t total = GETSIZE(ptr) + GETSIZE(bp);
+    pthread_mutex_unlock(&a->lock);
+}
 
-        if(total >= asize)
-        {
-            size_t nsize = total - asize;
-            tree_root = mm_remove(tree_root,bp);
-            
-            if(nsize < 16)
-            {
-                PUT(HDRP(ptr), PACK(total, 1));
-                PUT(FTRP(ptr), PACK(total, 1));
-                return ptr;
+/*
+ * mm_region_create - Start an empty region; returns NULL if out of memory
+ */
+mm_region_t *mm_region_create(void)
+{
+    mm_region_t *r;
+    char *c;
+
+    if ((c = mm_malloc(REGIONCHUNK)) == NULL)
+        return NULL;
+
+    CHUNKLINK(c) = NULL;
+    r = (mm_region_t *)(c + DSIZE);
+    r->chunks = c;
+    r->bump = c + DSIZE * ((DSIZE + sizeof(mm_region_t) + DSIZE-1) / DSIZE);
+    r->end = c + REGIONCHUNK;
+    return r;
+}
+
+/*
+ * mm_region_alloc - Allocate size bytes from region r, aligned like
+ *     mm_malloc. The memory is only given back by mm_region_destroy and
+ *     must never be passed to mm_free or mm_realloc.
+ */
+void *mm_region_alloc(mm_region_t *r, size_t size)
+{
+    size_t asize = DSIZE * ((size + DSIZE-1) / DSIZE);
+    char *bp, *c;
+
+    if (size <= 0)
+        return NULL;
+
+    if (asize <= (size_t)(r->end - r->bump)) {
+        bp = r->bump;
+        r->bump += asize;
+        return bp;
+    }
+
+    /* Large requests leave the current chunk to the small ones */
+    if (asize > REGIONBIG) {
+        if ((c = mm_malloc(DSIZE + asize)) == NULL)
+            return NULL;
+        CHUNKLINK(c) = CHUNKLINK(r->chunks);
+        CHUNKLINK(r->chunks) = c;
+        return c + DSIZE;
+    }
+
+    if ((c = mm_malloc(REGIONCHUNK)) == NULL)
+        return NULL;
+    CHUNKLINK(c) = r->chunks;
+    r->chunks = c;
+    r->bump = c + DSIZE + asize;
+    r->end = c + REGIONCHUNK;
+    return c + DSIZE;
+}
+
+/*
+ * mm_region_destroy - Release everything allocated from region r, and r
+ *     itself, in O(chunks) time: one free per chunk, whatever the number
+ *     of allocations. Each chunk goes back to its arena as a single
+ *     block, coalescing with its neighbours, often the region's previous
+ *     chunk. Allocations of over REGIONBIG bytes each add a chunk, so
+ *     the cost grows with their number.
+ */
+void mm_region_destroy(mm_region_t *r)
+{
+    char *c, *next;
+
+    for (c = r->chunks; c != NULL; c = next) {
+        next = CHUNKLINK(c);
+        mm_free(c);
+    }
+}
+
+/*
+ * mm_seg_stats - Report the block size and hit/miss counts of size
+ *     class cls, summed over all arenas. Returns 0 once cls is past
+ *     the last class.
+ */
+int mm_seg_stats(int cls, size_t *size, long *hits, long *misses)
+{
+    int i;
+
+    if (cls < 0 || cls >= NUMCLASSES)
+        return 0;
+
+    *size = MINBLOCKSIZE + cls * DSIZE;
+    *hits = 0;
+    *misses = 0;
+    for (i = 0; i < NUMARENAS; i++) {
+        *hits += arenas[i].seg_hits[cls];
+        *misses += arenas[i].seg_misses[cls];
+    }
+    return 1;
+}
+
+/*
+ * mm_stats - Sum the event counters of all arenas into *stats and
+ *     describe the free blocks currently in the heap
+ */
+void mm_stats(mm_stats_t *stats)
+{
+    arena_t *a;
+    char *seg;
+    char *bp;
+    size_t size;
+    int i, k, bin;
+
+    memset(stats, 0, sizeof(mm_stats_t));
+
+    for (i = 0; i < NUMARENAS; i++) {
+        a = &arenas[i];
+        pthread_mutex_lock(&a->lock);
+
+        stats->ceiling_calls += a->stats.ceiling_calls;
+        stats->ceiling_visits += a->stats.ceiling_visits;
+        stats->split_front += a->stats.split_front;
+        stats->split_back += a->stats.split_back;
+        for (k = 0; k < 4; k++)
+            stats->coalesce[k] += a->stats.coalesce[k];
+        stats->extends += a->stats.extends;
+        stats->trims += a->stats.trims;
+        stats->realloc_inplace += a->stats.realloc_inplace;
+        stats->realloc_prev += a->stats.realloc_prev;
+        stats->realloc_copy += a->stats.realloc_copy;
+        stats->quick_hits += a->stats.quick_hits;
+        stats->quick_misses += a->stats.quick_misses;
+        stats->quick_flushes += a->stats.quick_flushes;
+        stats->tree_depth = MAX(stats->tree_depth, tree_depth(a->tree_root));
+
+        for (seg = a->last_seg; seg != NULL; seg = SEGLINK(seg)) {
+            for (bp = seg + PROLOGSIZE; (size = GET_SIZE(HDRP(bp))) > 0; bp = NEXT_BLKP(bp)) {
+                if (GET_ALLOC(HDRP(bp)))
+                    continue;
+
+                stats->free_blocks++;
+                stats->free_bytes += size;
+                stats->free_largest = MAX(stats->free_largest, size);
+                bin = (63 - __builtin_clzll(size)) - 4;
+                stats->free_bins[MAX(0, MIN(bin, MM_SIZEBINS-1))]++;
             }
-            else 
-            {
-                PUT(HDRP(ptr), PACK(asize, 1));
-                PUT(FTRP(ptr), PACK(asize, 1));
-                
-                void *blk = NEXT_BLKP(ptr);
-                PUT(HDRP(blk), PACK(nsize,0));
-                PUT(FTRP(blk), PACK(nsize,0));
-                tree_root = mm_insert(tree_root, blk);
-                
-                return ptr;
-            }                                    
         }
 
-        else if(!GETSIZE(NEXT_BLKP(bp)))
-        {
-            size_t extendsize = MAX(asize, CHUNKSIZE);
-            extend_heap(extendsize/4);
-            size_t nsize = extendsize + total - asize;
-            
-            PUT(HDRP(ptr), PACK(asize,1));
-            PUT(FTRP(ptr), PACK(asize,1));
-
-            void *blk = NEXT_BLKP(ptr);
-            PUT(HDRP(blk), PACK(nsize,0));
-            PUT(FTRP(blk), PACK(nsize,0));
-            tree_root = mm_insert(tree_root, blk);
-            return ptr;
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    stats->mmaps = mmaps;
+    stats->remaps = remaps;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* 
+ * mm_checkheap - Check every segment of every arena for consistency:
+ *     each block on its own, the red-black and ordering invariants of
+ *     the free tree, the size class lists, and that the free blocks in
+ *     the heap are exactly those in the tree and lists. Must not run
+ *     concurrently with any other mm_ call. Returns the number of errors.
+ */
+int mm_checkheap(int verbose) 
+{
+    char *seg;
+    char *bp;
+    void *m;
+    long free_blocks, listed;
+    int i, cls, errors = 0;
+
+    for (i = 0; i < NUMARENAS; i++) {
+        arena_t *a = &arenas[i];
+
+        if (verbose && a->last_seg != NULL) {
+            printf("Arena %d (%p):\n", i, a->heap_listp);
+            printf("Root (%p):\n", a->tree_root);
+        }
+
+        free_blocks = 0;
+        for (seg = a->last_seg; seg != NULL; seg = SEGLINK(seg)) {
+            bp = seg + DSIZE;
+
+            if ((GET_SIZE(HDRP(bp)) != DSIZE) || !GET_ALLOC(HDRP(bp)))
+                errors += heap_error(bp, "is a bad prologue");
+
+            for (bp = NEXT_BLKP(bp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+                if (verbose)
+                    printblock(bp);
+
+                errors += checkblock(a, bp);
+                if (!GET_ALLOC(HDRP(bp)))
+                    free_blocks++;
+            }
+
+            if (verbose)
+                printblock(bp);
+
+            if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))
+                errors += heap_error(bp, "is a bad epilogue");
+        }
+
+        /* Every free block must be in the tree or a list, and no more */
+        listed = 0;
+        if (IS_RED(a->tree_root))
+            errors += heap_error(a->tree_root, "is a red root");
+        check_tree(a->tree_root, NULL, 0, (size_t)-1, &listed, &errors);
+        for (cls = 0; cls < NUMCLASSES; cls++) {
+            if (!(a->seg_map & (1ULL << cls)) != (a->seg_lists[cls] == NULL))
+                errors += heap_error(a->seg_lists[cls], "heads a size class list seg_map disagrees with");
+            for (m = a->seg_lists[cls]; m != NULL && listed <= free_blocks; m = NEXT(m)) {
+                if (GET_ALLOC(HDRP(m)) || GETSIZE(m) != MINBLOCKSIZE + cls*DSIZE)
+                    errors += heap_error(m, "is in the wrong size class list");
+                listed++;
+            }
+        }
+        if (listed != free_blocks) {
+            printf("Error: arena %d has %ld free blocks but %ld in its free lists\n",
+                   i, free_blocks, listed);
+            errors++;
         }
     }
+
+    return errors;
+}
+
+/* The remaining routines are internal helper routines */
+
+/*
+ * adjust_size - Block size for a request of size payload bytes
+ */
+static size_t adjust_size(size_t size)
+{
+    /* Adjust block size to include overhead and alignment reqs. */
+    if (size <= MINBLOCKSIZE - OVERHEAD)
+        return MINBLOCKSIZE;
+    else
+        return DSIZE * ((size + (OVERHEAD) + (DSIZE-1)) / DSIZE);
+}
+
+/*
+ * mmap_malloc - Give a block of at least size payload bytes a mapping
+ *     of its own
+ */
+static void *mmap_malloc(size_t size)
+{
+    char *region;
+    char *bp;
+
+    if (size > MAXREQUEST)
+        return NULL;
+
+    pthread_mutex_lock(&heap_lock);
+    if ((region = mem_map(size + DSIZE)) != NULL)
+        mmaps++;
+    pthread_mutex_unlock(&heap_lock);
+
+    if (region == NULL)
+        return NULL;
+
+    bp = region + DSIZE;
+    MAPFRONT(bp) = 0;
+    PUT(HDRP(bp), PACK(mem_mapsize(region), 1|MMAPPED));
+    return bp;
+}
+
+/*
+ * mmap_memalign - Give a block of at least size payload bytes at a
+ *     multiple of align a mapping of its own, align bytes larger than
+ *     mmap_malloc's so that the block can start at the first multiple
+ */
+static void *mmap_memalign(size_t align, size_t size)
+{
+    size_t front;
+    char *region;
+    char *bp;
+
+    if (size > MAXREQUEST || align > MAXREQUEST - size)
+        return NULL;
+
+    pthread_mutex_lock(&heap_lock);
+    if ((region = mem_map(size + align + DSIZE)) != NULL)
+        mmaps++;
+    pthread_mutex_unlock(&heap_lock);
+
+    if (region == NULL)
+        return NULL;
+
+    bp = (char *)(((size_t)region + DSIZE + align-1) & ~(align-1));
+    front = bp - DSIZE - region;
+    MAPFRONT(bp) = front;
+    PUT(HDRP(bp), PACK(mem_mapsize(region) - front, 1|MMAPPED));
+    return bp;
+}
+
+/*
+ * mmap_free - Give the mapping of block bp back to the system
+ */
+static void mmap_free(void *bp)
+{
+    pthread_mutex_lock(&heap_lock);
+    mem_unmap((char *)bp - DSIZE - MAPFRONT(bp));
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * mmap_realloc - Resize the mapping of block ptr, letting the kernel
+ *     move its pages rather than copying them. A block that shrinks
+ *     below the threshold moves back into the heap.
+ */
+static void *mmap_realloc(void *ptr, size_t size)
+{
+    char *region;
+    void *bp;
+
+    if (size > MAXREQUEST)
+        return NULL;
+    if (size < MMAPTHRESHOLD) {
+        if ((bp = mm_malloc(size)) == NULL)
+            return NULL;
+        memcpy(bp, ptr, size);
+        mmap_free(ptr);
+        return bp;
+    }
+
+    /* Remapping would drop the front of an aligned block, so it moves */
+    if (MAPFRONT(ptr) != 0) {
+        size_t copysize = GETSIZE(ptr) - DSIZE;
+
+        if ((bp = mmap_malloc(size)) == NULL)
+            return NULL;
+        memcpy(bp, ptr, copysize < size ? copysize : size);
+        mmap_free(ptr);
+        return bp;
+    }
+
+    /* Stay put while the size is within the mapping's last page */
+    if (size + DSIZE <= GETSIZE(ptr) && 
+        size + DSIZE + mem_pagesize() > GETSIZE(ptr))
+        return ptr;
+
+    pthread_mutex_lock(&heap_lock);
+    if ((region = mem_remap((char *)ptr - DSIZE, size + DSIZE)) != NULL)
+        remaps++;
+    pthread_mutex_unlock(&heap_lock);
+
+    if (region == NULL)
+        return NULL;
+
+    bp = region + DSIZE;
+    PUT(HDRP(bp), PACK(mem_mapsize(region), 1|MMAPPED));
+    return bp;
+}
+
+/*
+ * tree_depth - Number of nodes on the longest path down from h
+ */
+static int tree_depth(void *h)
+{
+    if (h == NULL)
+        return 0;
+
+    return 1 + MAX(tree_depth(LEFT(h)), tree_depth(RIGHT(h)));
+}
+
+/*
+ * arena_malloc - Allocate a block of asize bytes from arena a, whose
+ *     lock is held
+ */
+static void *arena_malloc(arena_t *a, size_t asize)
+{
+    size_t extendsize; /* amount to extend heap if no fit */
+    char *bp;
+#if QUICKLIST
+    int i;
+
+    /* Reuse the latest deferred free of exactly this size */
+    for (i = a->quick_count - 1; i >= 0; i--) {
+        if (GETSIZE(a->quick[i]) == asize) {
+            bp = a->quick[i];
+            a->quick[i] = a->quick[--a->quick_count];
+            a->stats.quick_hits++;
+            return bp;
+        }
+    }
+    a->stats.quick_misses++;
+    if (a->quick_count > 0)
+        quick_flush(a);
+#endif
+
+    /* Small sizes are served from the size class lists first */
+    if (asize <= SEGLIMIT && (bp = seg_alloc(a, asize)) != NULL) {
+#if ADDRORDER
+        a->last_alloc = bp;
+#endif
+        return bp;
+    }
     
-    bp = mm_malloc(size);
-    
-    memcpy(bp, ptr, (GETSIZE(ptr) - DSIZE));
-    mm_free(ptr);
+    /* Search the free tree for a fit */
+    a->stats.ceiling_calls++;
+    if ((bp = mm_ceiling(a->tree_root, asize, &a->stats.ceiling_visits)) != NULL) 
+    {
+#if ADDRORDER
+        bp = mm_nearest(bp, near_target(a));
+#endif
+        free_remove(a, bp);
+        bp = place(a, bp, asize);
+#if ADDRORDER
+        a->last_alloc = bp;
+#endif
+        return bp;
+    }
+
+    /* No fit found. Get more memory and place the block */
+    extendsize = MAX(asize,CHUNKSIZE);
+
+    if ((bp = extend_heap(a, extendsize/WSIZE)) == NULL)
+        return NULL;
+
+    bp = place(a, bp, asize);
+#if ADDRORDER
+    a->last_alloc = bp;
+#endif
+
+    return bp;
+}
+
+#if ADDRORDER
+/*
+ * near_target - Where arena a's next allocation should go: the caller's
+ *     hint if there is one, else next to its latest allocation
+ */
+static void *near_target(arena_t *a)
+{
+    return a->hint != NULL ? a->hint : a->last_alloc;
+}
+#endif
+
+/*
+ * arena_free - Free a block of arena a, whose lock is held
+ */
+static void arena_free(arena_t *a, void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+
+    PUT(HDRP(bp), PACK(size, GET_PREVALLOC(HDRP(bp))));
+    PUT(FTRP(bp), PACK(size, 0));
+    CLR_PREVALLOC(NEXT_BLKP(bp));
+
+    free_insert(a, arena_trim(a, coalesce(a, bp), bp, size));
+}
+
+/*
+ * arena_realloc - Resize a block of arena a, whose lock is held. A
+ *     shrinking block gives its tail back. A growing block first tries
+ *     to absorb the free block after it, extending the heap by just the
+ *     shortfall when that is the last block, and then slides down into
+ *     a free block before it. A block resized again right away grows
+ *     by half its size or more, so runs of small growths stay in place.
+ */
+static void *arena_realloc(arena_t *a, void *ptr, size_t size)
+{
+    size_t asize = adjust_size(size);
+    size_t oldsize = GETSIZE(ptr);
+    size_t target = asize;
+    size_t csize, copysize;
+    void *next, *prev, *tail, *bp;
+
+    /* Shrinks and growths into earlier headroom need no new memory */
+    if (asize <= oldsize) {
+        if (ptr != a->last_realloc || oldsize - asize > oldsize / 2)
+            realloc_fit(a, ptr, oldsize, asize);
+        a->stats.realloc_inplace++;
+        a->last_realloc = ptr;
+        return ptr;
+    }
+
+    if (ptr == a->last_realloc) {
+        target = (oldsize + oldsize/2 + DSIZE-1) & ~(size_t)(DSIZE-1);
+        target = MAX(asize, MIN(target, adjust_size(MMAPTHRESHOLD-1)));
+    }
+
+    /* Count in the next block if it is free */
+    next = NEXT_BLKP(ptr);
+    csize = oldsize;
+    if (!GET_ALLOC(HDRP(next)))
+        csize += GETSIZE(next);
+
+    /* Free space that ends the arena's heap grows by just the shortfall */
+    tail = (csize > oldsize) ? NEXT_BLKP(next) : next;
+    if (csize < target && HDRP(tail) == a->epilogue) {
+        bp = extend_heap(a, (target - csize) / WSIZE);
+        if (bp == next) {
+            /* The extension coalesced with next, which left the tree */
+            CHECK_MERGED(a, next, ptr);
+            realloc_fit(a, ptr, oldsize + GETSIZE(next), target);
+            a->stats.realloc_inplace++;
+            a->last_realloc = ptr;
+            return ptr;
+        }
+        if (bp != NULL)
+            free_insert(a, bp);
+    }
+
+    if (csize >= asize) {
+        free_remove(a, next);
+        CHECK_MERGED(a, next, ptr);
+        realloc_fit(a, ptr, csize, MIN(csize, target));
+        a->stats.realloc_inplace++;
+        a->last_realloc = ptr;
+        return ptr;
+    }
+
+    /* Slide down into a free previous block */
+    if (!GET_PREVALLOC(HDRP(ptr))) {
+        prev = PREV_BLKP(ptr);
+        if (csize + GETSIZE(prev) >= asize) {
+            free_remove(a, prev);
+            if (csize > oldsize) {
+                free_remove(a, next);
+                CHECK_MERGED(a, next, prev);
+            }
+            CHECK_MERGED(a, ptr, prev);
+            csize += GETSIZE(prev);
+            memmove(prev, ptr, oldsize - OVERHEAD);
+            realloc_fit(a, prev, csize, MIN(csize, target));
+            a->stats.realloc_prev++;
+            a->last_realloc = prev;
+            return prev;
+        }
+    }
+
+    if ((bp = arena_malloc(a, target)) == NULL)
+        return NULL;
+    a->stats.realloc_copy++;
+    a->last_realloc = bp;
+
+    copysize = oldsize - OVERHEAD;
+    memcpy(bp, ptr, copysize < size ? copysize : size);
+    arena_free(a, ptr);
     return bp;  
 }
 
-/* 
- * mm_checkheap - Check the heap for consistency 
+/*
+ * arena_carve - Cut up to n consecutive blocks of asize bytes, no more
+ *     than CARVELIMIT bytes in all, from one free block of arena a,
+ *     whose lock is held, storing them in ptrs. The block comes from a
+ *     single tree search or heap extension. Returns the number of
+ *     blocks cut, or 0 if they are few enough for the size classes or
+ *     no memory is left.
  */
-void mm_checkheap(int verbose) 
+static int arena_carve(arena_t *a, size_t asize, int n, void **ptrs)
 {
-    char *bp = heap_listp;
+    size_t total, csize, prev_alloc;
+    char *bp;
+    int i;
+
+    if ((size_t)n > CARVELIMIT / asize)
+        n = CARVELIMIT / asize;
+    total = asize * n;
+    if (total <= SEGLIMIT)
+        return 0;
+
+    a->stats.ceiling_calls++;
+    if ((bp = mm_ceiling(a->tree_root, total, &a->stats.ceiling_visits)) != NULL)
+        free_remove(a, bp);
+    else if ((bp = extend_heap(a, MAX(total, CHUNKSIZE)/WSIZE)) == NULL)
+        return 0;
+
+    csize = GETSIZE(bp);
+    prev_alloc = GET_PREVALLOC(HDRP(bp));
+    for (i = 0; i < n; i++) {
+        PUT(HDRP(bp), PACK(asize, 1|prev_alloc));
+        ptrs[i] = bp;
+        bp += asize;
+        prev_alloc = PREVALLOC;
+    }
 
-    if (verbose) {
-        printf("Heap (%p):\n", heap_listp);
-        printf("Root (%p):\n", tree_root);
+    /* Free what is left over, or give it to the last block */
+    if (csize - total >= MINBLOCKSIZE) {
+        PUT(HDRP(bp), PACK(csize - total, PREVALLOC));
+        PUT(FTRP(bp), PACK(csize - total, 0));
+        free_insert(a, bp);
+    }
+    else {
+        bp = ptrs[n-1];
+        PUT(HDRP(bp), PACK(asize + csize - total, 1|GET_PREVALLOC(HDRP(bp))));
+        SET_PREVALLOC(NEXT_BLKP(bp));
     }
 
-    if ((GET_SIZE(HDRP(heap_listp)) != DSIZE) || !GET_ALLOC(HDRP(heap_listp)))
-        printf("Bad prologue header\n");
-    
-    checkblock(heap_listp);
+    return n;
+}
+
+/*
+ * sort_blocks - Shell sort n block pointers into address order
+ */
+static void sort_blocks(void **ptrs, int n)
+{
+    int gap, i, j;
+    void *bp;
+
+    for (gap = n/2; gap > 0; gap /= 2) {
+        for (i = gap; i < n; i++) {
+            bp = ptrs[i];
+            for (j = i; j >= gap && (char *)ptrs[j-gap] > (char *)bp; j -= gap)
+                ptrs[j] = ptrs[j-gap];
+            ptrs[j] = bp;
+        }
+    }
+}
 
-    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-        if (verbose)
-            printblock(bp);
+/*
+ * realloc_fit - Make the allocated block bp, which now spans csize
+ *     bytes, asize bytes long and free the rest if it can hold a block
+ */
+static void realloc_fit(arena_t *a, void *bp, size_t csize, size_t asize)
+{
+    size_t prev_alloc = GET_PREVALLOC(HDRP(bp));
+    void *tail;
 
-        checkblock(bp);
+    if (csize - asize < MINBLOCKSIZE) {
+        PUT(HDRP(bp), PACK(csize, 1|prev_alloc));
+        SET_PREVALLOC(NEXT_BLKP(bp));
+        return;
     }
-     
-    if (verbose)
-        printblock(bp);
 
-    if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))
-        printf("Bad epilogue header\n");
+    PUT(HDRP(bp), PACK(asize, 1|prev_alloc));
+    tail = NEXT_BLKP(bp);
+    PUT(HDRP(tail), PACK(csize - asize, PREVALLOC));
+    PUT(FTRP(tail), PACK(csize - asize, 0));
+    CLR_PREVALLOC(NEXT_BLKP(tail));
+    free_insert(a, arena_trim(a, coalesce(a, tail), tail, csize - asize));
 }
 
-/* The remaining routines are internal helper routines */
+#if QUICKLIST
+/*
+ * quick_flush - Free and coalesce all the deferred frees of arena a,
+ *     whose lock is held
+ */
+static void quick_flush(arena_t *a)
+{
+    int i;
+
+    for (i = 0; i < a->quick_count; i++)
+        arena_free(a, a->quick[i]);
+    a->quick_count = 0;
+    a->stats.quick_flushes++;
+}
+#endif
+
+/*
+ * arena_drain - Free the blocks other threads pushed on the remote list
+ *     of arena a, whose lock is held
+ */
+static void arena_drain(arena_t *a)
+{
+    void *bp, *next;
+
+    if (a->remote == NULL)
+        return;
+
+    for (bp = __sync_lock_test_and_set(&a->remote, NULL); bp != NULL; bp = next) {
+        next = NEXT(bp);
+        arena_free(a, bp);
+    }
+}
+
+/*
+ * arena_trim - Give the memory of free block bp of arena a, whose lock
+ *     is held, back to the system once the block reaches TRIMTHRESHOLD
+ *     bytes. bp was just coalesced from the len bytes of block freed
+ *     and its free neighbours. A block that ends the heap shrinks it
+ *     down to CHUNKSIZE. Any other block releases the pages between its
+ *     links and its footer, except those of a neighbour that had
+ *     reached TRIMTHRESHOLD itself: they went back when it did, and
+ *     releasing them again would cost a syscall per free next to a
+ *     large free span. Returns the block.
+ */
+static void *arena_trim(arena_t *a, void *bp, void *freed, size_t len)
+{
+    size_t size = GETSIZE(bp);
+    size_t trim;
+    char *lo, *hi;
+
+    if (size < TRIMTHRESHOLD)
+        return bp;
+
+    pthread_mutex_lock(&heap_lock);
+
+    if (HDRP(NEXT_BLKP(bp)) != a->epilogue ||
+        a->epilogue + WSIZE != (char *)mem_heap_hi() + 1) {
+        pthread_mutex_unlock(&heap_lock);
+        lo = (char *)bp + TREEWORDS*LINKSIZE;
+        hi = (char *)bp + size - DSIZE;
+        if ((char *)freed - (char *)bp >= TRIMTHRESHOLD)
+            lo = freed;
+        if ((char *)bp + size - ((char *)freed + len) >= TRIMTHRESHOLD)
+            hi = (char *)freed + len;
+        if (hi > lo)
+            mem_release(lo, hi - lo);
+        return bp;
+    }
+
+    /* Whole grains keep the segments of arenas past 0 grain aligned */
+    trim = (size - CHUNKSIZE) & ~(size_t)(GRAIN-1);
+
+    /* mem_sbrk takes an int, so no more than that goes back at once */
+    trim = MIN(trim, (size_t)INT_MAX & ~(size_t)(GRAIN-1));
+    if (mem_sbrk(-(int)trim) != (void *)-1) {
+        CHECK_MERGED(a, NEXT_BLKP(bp), bp);
+        size -= trim;
+        PUT(HDRP(bp), PACK(size, GET_PREVALLOC(HDRP(bp))));
+        PUT(FTRP(bp), PACK(size, 0));
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
+        a->epilogue = HDRP(NEXT_BLKP(bp));
+        if (a != &arenas[0])
+            memset(&arena_owner[((char *)NEXT_BLKP(bp) - heap_lo) >> GRAINSHIFT],
+                   0, trim >> GRAINSHIFT);
+        a->stats.trims++;
+    }
+
+    pthread_mutex_unlock(&heap_lock);
+    return bp;
+}
+
+/*
+ * arena_of - Return the arena that owns block bp
+ */
+static arena_t *arena_of(void *bp)
+{
+    return &arenas[arena_owner[((char *)bp - heap_lo) >> GRAINSHIFT]];
+}
+
+/*
+ * arena_get - Return the arena of the calling thread, binding the
+ *     thread round robin on its first call. tcache_flush unbinds it
+ *     when it exits.
+ */
+static arena_t *arena_get(void)
+{
+    if (thread_arena == NULL) {
+        thread_arena = &arenas[__sync_fetch_and_add(&next_arena, 1) % NUMARENAS];
+        thread_generation = generation;
+        __sync_fetch_and_add(&thread_arena->threads, 1);
+        pthread_setspecific(tcache_key, &tcache);
+    }
+
+    return thread_arena;
+}
+
+/*
+ * tcache_get - Return the calling thread's cache, emptied if it was
+ *     filled before the last mm_init
+ */
+static tcache_t *tcache_get(void)
+{
+    tcache_t *tc = &tcache;
+
+    if (tc->generation != generation) {
+        memset(tc, 0, sizeof(tcache_t));
+        tc->generation = generation;
+        tc->arena = arena_get();
+        pthread_setspecific(tcache_key, tc);
+    }
+
+    return tc;
+}
+
+/*
+ * tcache_flush - Give the blocks of an exiting thread's cache back to
+ *     its arena, and unbind the thread from the arena. The last thread
+ *     to leave drains the remote list, which nobody else would.
+ */
+static void tcache_flush(void *arg)
+{
+    tcache_t *tc = arg;
+    arena_t *a = thread_arena;
+    void *bp, *next;
+    int i;
+
+    if (thread_generation != generation)
+        return;
+
+    pthread_mutex_lock(&a->lock);
+    if (tc->generation == generation) {
+        for (i = 0; i < TCACHECLASSES; i++) {
+            for (bp = tc->bins[i]; bp != NULL; bp = next) {
+                next = LEFT(bp);
+                arena_free(tc->arena, bp);
+            }
+        }
+    }
+    if (__sync_sub_and_fetch(&a->threads, 1) == 0)
+        arena_drain(a);
+    pthread_mutex_unlock(&a->lock);
+
+    /* Frees from later destructors bind the thread again */
+    tc->generation = 0;
+    thread_arena = NULL;
+}
+
+/*
+ * tcache_key_init - Register tcache_flush to run at thread exit
+ */
+static void tcache_key_init(void)
+{
+    pthread_key_create(&tcache_key, tcache_flush);
+}
 
 /* 
- * extend_heap - Extend heap with free block and return its block pointer
+ * extend_heap - Extend the heap of arena a with a free block and return
+ *     its block pointer. The block continues the arena's last segment
+ *     when nobody else has called mem_sbrk since, and starts a new
+ *     segment otherwise.
  */
 /* $begin mmextendheap */
-static void *extend_heap(size_t words) 
+static void *extend_heap(arena_t *a, size_t words) 
 {
     char *bp;
+    char *brk;
     size_t size;
     
+    if (words > MAXEXTEND / WSIZE)
+        return NULL;
+
     /* Allocate an even number of words to maintain alignment */
     size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
-    if ((int)(bp = mem_sbrk(size)) == -1) 
+
+    pthread_mutex_lock(&heap_lock);
+
+    brk = (char *)mem_heap_hi() + 1;
+    if (a->epilogue == NULL || a->epilogue + WSIZE != brk) {
+        if ((bp = new_segment(a, size)) != NULL)
+            a->stats.extends++;
+        pthread_mutex_unlock(&heap_lock);
+        return bp;
+    }
+
+    /* Arenas other than 0 always end their segments on a grain */
+    if (a != &arenas[0])
+        size = (size + GRAIN-1) & ~(GRAIN-1);
+
+    if ((bp = mem_sbrk(size)) == (void *)-1) {
+        pthread_mutex_unlock(&heap_lock);
+        return NULL;
+    }
+
+    if (a != &arenas[0])
+        memset(&arena_owner[(bp - heap_lo) >> GRAINSHIFT],
+               a - arenas, size >> GRAINSHIFT);
+
+    /* Initialize free block header/footer and the epilogue header */
+    PUT(HDRP(bp), PACK(size, GET_PREVALLOC(HDRP(bp)))); /* free block header */
+    PUT(FTRP(bp), PACK(size, 0));         /* free block footer */
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* new epilogue header */
+    a->epilogue = HDRP(NEXT_BLKP(bp));
+    a->stats.extends++;
+
+    pthread_mutex_unlock(&heap_lock);
+
+    /* Coalesce if the previous block was free */
+    return coalesce(a, bp);
+}
+/* $end mmextendheap */
+
+/*
+ * new_segment - Start a new segment of arena a holding one free block
+ *     of size bytes, and return that block. Segments of arenas other
+ *     than 0 are grain aligned so arena_of can find their owner.
+ *     Called with heap_lock held.
+ */
+static void *new_segment(arena_t *a, size_t size)
+{
+    size_t start = mem_heapsize();
+    size_t pad = 0;
+    size_t total;
+    char *seg;
+    char *bp;
+
+    if (size > MAXEXTEND)
+        return NULL;
+
+    if (a != &arenas[0]) {
+        pad = (GRAIN - start % GRAIN) % GRAIN;
+        total = (start + pad + PROLOGSIZE + size + GRAIN-1) & ~(GRAIN-1);
+        size = total - start - pad - PROLOGSIZE;
+    }
+    total = pad + PROLOGSIZE + size;
+
+    if ((seg = mem_sbrk(total)) == (void *)-1)
         return NULL;
+    seg += pad;
 
-    /* Initialize free block header/footer and the epilogue header */
-    PUT(HDRP(bp), PACK(size, 0));         /* free block header */
-    PUT(FTRP(bp), PACK(size, 0));         /* free block footer */
-    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* new epilogue header */
+    if (a != &arenas[0])
+        memset(&arena_owner[(start + pad) >> GRAINSHIFT], a - arenas,
+               (total - pad) >> GRAINSHIFT);
 
-    /* Coalesce if the previous block was free */
-    return coalesce(bp);
+    SETSEGLINK(seg, a->last_seg);              /* previous segment */
+    PUT(seg+WSIZE, PACK(DSIZE, 1|PREVALLOC));  /* prologue header */ 
+    PUT(seg+DSIZE, PACK(DSIZE, 1));            /* prologue footer */ 
+
+    bp = seg + PROLOGSIZE;
+    PUT(HDRP(bp), PACK(size, PREVALLOC));      /* free block header */
+    PUT(FTRP(bp), PACK(size, 0));              /* free block footer */
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));      /* epilogue header */
+
+    if (a->last_seg == NULL)
+        a->heap_listp = seg + DSIZE;
+    a->last_seg = seg;
+    a->epilogue = HDRP(NEXT_BLKP(bp));
+
+    return bp;
 }
-/* $end mmextendheap */
 
 /* 
  * place - Place block of asize bytes at start of free block bp 
@@ -321,128 +1789,99 @@ static void *extend_heap(size_t words)
  */
 /* $begin mmplace */
 /* $begin mmplace-proto */
-static void *place(void *bp, size_t asize)
+static void *place(arena_t *a, void *bp, size_t asize)
 /* $end mmplace-proto */
 {
     size_t csize = GET_SIZE(HDRP(bp));
     size_t split_size = (csize - asize);
 
-    if (split_size >= (DSIZE + OVERHEAD)) {
-        size_t avg = (GETSIZE(NEXT_BLKP(bp)) + GETSIZE(PREV_BLKP(bp)))/2; 
-        void* large;
-        void* small;
+    /* Keep a running average of the placed block sizes */
+    if (a->avg_size == 0)
+        a->avg_size = asize;
+    else
+        a->avg_size += ((long)asize - (long)a->avg_size) / 8;
+
+    if (split_size >= MINBLOCKSIZE) {
         int split_side;
 
         /* Which side should we split on? Let split_side = 0 or 1
            0 = Let's split the end
            1 = Let's split the front 
+           The size of the allocated block before bp is unknown without
+           its footer, so blocks at least as large as the arena's recent
+           average go to the front and smaller ones to the end, keeping
+           large and small blocks apart.
         */
-        
-        if(GETSIZE(NEXT_BLKP(bp)) > GETSIZE(PREV_BLKP(bp)))
-        {
-            large = NEXT_BLKP(bp);
-            small = PREV_BLKP(bp);
-        }
-        else
-        {
-            large = PREV_BLKP(bp);
-            small = NEXT_BLKP(bp);
-        }
-         
-        if(asize > avg)
-        {
-            if(PREV_BLKP(bp) == large)
-                split_side = 0;
-            else 
-                split_side = 1;           
-        }
-        else
-        {
-            if(PREV_BLKP(bp) == large)
-                split_side = 1;
-            else 
-                split_side = 0;
-        }
+        split_side = asize < a->avg_size;
+#if ADDRORDER
+        /* Unless the caller gave a hint to split towards */
+        if (a->hint != NULL)
+            split_side = (char *)a->hint > (char *)bp;
+#endif
         
         if(split_side != 1)
         {
-            PUT(HDRP(bp), PACK(asize, 1));
-            PUT(FTRP(bp), PACK(asize, 1));
+            a->stats.split_front++;
+            PUT(HDRP(bp), PACK(asize, 1|PREVALLOC));
 
             void* split = NEXT_BLKP(bp);
 
-            PUT(HDRP(split), PACK(csize-asize, 0));
-            PUT(FTRP(split), PACK(csize-asize, 0));
+            PUT(HDRP(split), PACK(split_size, PREVALLOC));
+            PUT(FTRP(split), PACK(split_size, 0));
 
-            tree_root = mm_insert(tree_root,split);
+            free_insert(a, split);
 
             return bp;
         }
         else
         {
-            PUT(HDRP(bp), PACK(split_size,0));
-            PUT(FTRP(bp), PACK(split_size,0));
+            a->stats.split_back++;
+            PUT(HDRP(bp), PACK(split_size, PREVALLOC));
+            PUT(FTRP(bp), PACK(split_size, 0));
         
             void *blk = NEXT_BLKP(bp);
 
             PUT(HDRP(blk), PACK(asize, 1));
-            PUT(FTRP(blk), PACK(asize, 1));
+            SET_PREVALLOC(NEXT_BLKP(blk));
 
-            tree_root = mm_insert(tree_root,bp);
+            free_insert(a, bp);
 
             return blk;
         }
     }
     else
     { 
-        PUT(HDRP(bp), PACK(csize, 1));
-        PUT(FTRP(bp), PACK(csize, 1));
+        PUT(HDRP(bp), PACK(csize, 1|PREVALLOC));
+        SET_PREVALLOC(NEXT_BLKP(bp));
         return bp;
     }
 }
 /* $end mmplace */
 
-/* 
- * find_fit - Find a fit for a block with asize bytes 
- */
-/* $begin mmfirstfit */
-/* $begin mmfirstfit-proto */
-static void *find_fit(size_t asize)
-/* $end mmfirstfit-proto */
-{
-    void *bp;
-
-    /* first fit search */
-    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-        if (!GET_ALLOC(HDRP(bp)) && (asize <= GET_SIZE(HDRP(bp)))) {
-            return bp;
-        }
-    }
-    return NULL; /* no fit */
-}
-/* $end mmfirstfit */
-
 /*
  * coalesce - boundary tag coalescing. Return ptr to coalesced block
  */
 /* $begin mmfree */
-static void *coalesce(void *bp) 
+static void *coalesce(arena_t *a, void *bp) 
 {
-    size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
+    size_t prev_alloc = GET_PREVALLOC(HDRP(bp));
     size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
     size_t size = GET_SIZE(HDRP(bp));
 
     if (prev_alloc && next_alloc) {            /* Case 1: Neighbors both allocated */
+        a->stats.coalesce[0]++;
         return bp;
     }
 
     else if (prev_alloc && !next_alloc) {      /* Case 2: Only the previous is allocated*/
         size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+        a->stats.coalesce[1]++;
 
         /* If only the previous block is allocated, remove the next block */
-        tree_root = mm_remove(tree_root, NEXT_BLKP(bp));
+        free_remove(a, NEXT_BLKP(bp));
+        CHECK_MERGED(a, NEXT_BLKP(bp), bp);
 
-        PUT(HDRP(bp), PACK(size, 0));
+        PUT(HDRP(bp), PACK(size, PREVALLOC));
         PUT(FTRP(bp), PACK(size,0));
 
         return(bp);
@@ -450,25 +1889,30 @@ static void *coalesce(void *bp)
 
     else if (!prev_alloc && next_alloc) {      /* Case 3: Only the next is allocated */
         size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+        a->stats.coalesce[2]++;
 
         /* If only the next block is allocated, remove the previous block */
-        tree_root = mm_remove(tree_root, PREV_BLKP(bp));
+        free_remove(a, PREV_BLKP(bp));
+        CHECK_MERGED(a, bp, PREV_BLKP(bp));
 
         PUT(FTRP(bp), PACK(size, 0));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+        PUT(HDRP(PREV_BLKP(bp)), PACK(size, PREVALLOC));
 
         return(PREV_BLKP(bp));
     }
 
     else {                                     /* Case 4: Neither are allocated */
         size += GET_SIZE(HDRP(PREV_BLKP(bp))) + 
-            GET_SIZE(FTRP(NEXT_BLKP(bp)));
+            GET_SIZE(HDRP(NEXT_BLKP(bp)));
+        a->stats.coalesce[3]++;
 
         /* If neither blocks are allocated, remove them both */
-        tree_root = mm_remove(tree_root, NEXT_BLKP(bp));
-        tree_root = mm_remove(tree_root, PREV_BLKP(bp));
+        free_remove(a, NEXT_BLKP(bp));
+        free_remove(a, PREV_BLKP(bp));
+        CHECK_MERGED(a, NEXT_BLKP(bp), PREV_BLKP(bp));
+        CHECK_MERGED(a, bp, PREV_BLKP(bp));
 
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+        PUT(HDRP(PREV_BLKP(bp)), PACK(size, PREVALLOC));
         PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
 
         return(PREV_BLKP(bp));
@@ -478,251 +1922,761 @@ static void *coalesce(void *bp)
 
 static void printblock(void *bp) 
 {
-    size_t hsize, halloc, fsize, falloc;
+    size_t hsize, halloc, hprev, fsize, falloc;
 
     hsize = GET_SIZE(HDRP(bp));
     halloc = GET_ALLOC(HDRP(bp));  
-    fsize = GET_SIZE(FTRP(bp));
-    falloc = GET_ALLOC(FTRP(bp));  
+    hprev = GET_PREVALLOC(HDRP(bp));
 
     if (hsize == 0) {
         printf("%p: EOL\n", bp);
     return;
     }
 
-    if (bp == heap_listp) {
-      printf("%p: header: [%d:%c] footer: [%d:%c]\n", bp, hsize, (halloc ? 'a' : 'f'), fsize, (falloc ? 'a' : 'f')); 
-
-    } else if (!halloc) {
-      printf("%p: header: [%d:%c] | left: %p, right: %p | footer: [%d:%c]\n", bp, hsize, (halloc ? 'a' : 'f'),
-         LEFT(bp), RIGHT(bp), fsize, (falloc ? 'a' : 'f')); 
+    if (halloc) {
+      printf("%p: header: [%zu:%c%c]\n", bp, hsize, (halloc ? 'a' : 'f'), (hprev ? 'a' : 'f')); 
 
     } else {
-      printf("%p: header: [%d:%c] footer: [%d:%c]\n", bp, hsize, (halloc ? 'a' : 'f'), fsize, (falloc ? 'a' : 'f')); 
+      fsize = GET_SIZE(FTRP(bp));
+      falloc = GET_ALLOC(FTRP(bp));  
+      printf("%p: header: [%zu:%c%c] | left: %p, right: %p, parent: %p, next: %p | footer: [%zu:%c]\n", bp, hsize, (halloc ? 'a' : 'f'),
+         (hprev ? 'a' : 'f'), LEFT(bp), RIGHT(bp), PARENT(bp), NEXT(bp), fsize, (falloc ? 'a' : 'f')); 
     }
   
 }
 
-static void checkblock(void *bp) 
+/*
+ * heap_error - Report that block bp is what; returns 1 to count it
+ */
+static int heap_error(void *bp, char *what)
 {
-    if ((size_t)bp % 8)
-        printf("Error: %p is not doubleword aligned\n", bp);
-    if (GET(HDRP(bp)) != GET(FTRP(bp)))
-        printf("Error: header does not match footer\n");
+    printf("Error: %p %s\n", bp, what);
+    return 1;
 }
 
 /*
- * mm_insert - Insert a free block into the Binary Tree and return bp
+ * checkblock - Check block bp of arena a against its header, its
+ *     neighbour and, if it is free, its links; returns the number of
+ *     errors. Only looks at memory around bp, so it is cheap enough
+ *     for the incremental checker.
  */
-void *mm_insert(void *root, void* bp)
+static int checkblock(arena_t *a, void *bp) 
 {
-    /* Determine if the tree is empty and initiate all nodes to NULL */
+    size_t size = GETSIZE(bp);
+    int errors = 0;
+
+    if ((size_t)bp % DSIZE)
+        errors += heap_error(bp, "is not doubleword aligned");
+    if (size % DSIZE || size < MINBLOCKSIZE)
+        return errors + heap_error(bp, "has a bad size");
+    if (arena_of(bp) != a)
+        errors += heap_error(bp, "is not owned by its arena");
+    if (!GET_PREVALLOC(HDRP(NEXT_BLKP(bp))) != !GET_ALLOC(HDRP(bp)))
+        errors += heap_error(bp, "disagrees with the next block's prev-alloc bit");
+    if (GET_ALLOC(HDRP(bp)))
+        return errors;
+
+    if (size != GET(FTRP(bp)))
+        errors += heap_error(bp, "has a header that does not match its footer");
+    if (!GET_ALLOC(HDRP(NEXT_BLKP(bp))))
+        errors += heap_error(bp, "is not coalesced with the next block");
+    return errors + check_free(a, bp);
+}
 
-    if(root == NULL)
-    {
-        SETLEFT(bp, NULL);
-        SETRIGHT(bp, NULL);
-        return bp;
+/*
+ * check_free - Check that free block bp of arena a is linked both ways
+ *     with its neighbours in its size class list or the free tree, and
+ *     ordered against them; returns the number of errors
+ */
+static int check_free(arena_t *a, void *bp)
+{
+    size_t size = GETSIZE(bp);
+    void *next = NEXT(bp);
+    void *parent = PARENT(bp);
+    int errors = 0;
+
+    if (next != NULL && PREV(next) != bp)
+        errors += heap_error(bp, "is not linked back from its successor");
+
+    if (size <= SEGLIMIT) {
+        if (PREV(bp) == NULL ? a->seg_lists[CLASS(size)] != bp : NEXT(PREV(bp)) != bp)
+            errors += heap_error(bp, "is not linked from its size class list");
+#if ADDRORDER && ADDRSCAN == 0
+        else if (PREV(bp) != NULL && (char *)PREV(bp) > (char *)bp)
+            errors += heap_error(bp, "is out of address order in its size class list");
+#endif
+        return errors;
     }
 
-    else if(GETSIZE(bp) <= GETSIZE(root))
-    {
-        SETLEFT(root, mm_insert(LEFT(root),bp));
-        return root;
+    /* A chained block hangs off a tree node of the same size */
+    if (parent == NULL && bp != a->tree_root) {
+        if (PREV(bp) == NULL || NEXT(PREV(bp)) != bp)
+            errors += heap_error(bp, "is not linked from its chain");
+        else if (GETSIZE(PREV(bp)) != size)
+            errors += heap_error(bp, "is chained to a block of another size");
+#if ADDRORDER && ADDRSCAN == 0
+        else if ((char *)PREV(bp) > (char *)bp)
+            errors += heap_error(bp, "is out of address order in its chain");
+#endif
+        return errors;
     }
 
-    else if(GETSIZE(bp) >  GETSIZE(root))
-    {
-        SETRIGHT(root, mm_insert(RIGHT(root),bp));
-        return root;
-    }
-    
-    /* If there's an error, return -1 */
-    return -1;
+    if (parent != NULL && LEFT(parent) != bp && RIGHT(parent) != bp)
+        errors += heap_error(bp, "is not a child of its parent");
+    if (LEFT(bp) != NULL && (PARENT(LEFT(bp)) != bp || GETSIZE(LEFT(bp)) >= size))
+        errors += heap_error(bp, "has a bad left child");
+    if (RIGHT(bp) != NULL && (PARENT(RIGHT(bp)) != bp || GETSIZE(RIGHT(bp)) <= size))
+        errors += heap_error(bp, "has a bad right child");
+    if (IS_RED(bp) && (IS_RED(LEFT(bp)) || IS_RED(RIGHT(bp))))
+        errors += heap_error(bp, "is red with a red child");
+    return errors;
 }
 
 /*
- * mm_remove - Remove a node from the Binary Tree
+ * check_tree - Check the subtree rooted at h, whose sizes must lie in
+ *     [lo, hi], adding its blocks to *count and its errors to *errors.
+ *     Returns the subtree's black height.
  */
-void *mm_remove(void *root, void *bp)
+static int check_tree(void *h, void *parent, size_t lo, size_t hi,
+                      long *count, int *errors)
 {
-    /* Determine if there are any children, if not, remove the node */
-
-    if(mm_children(bp) == 0)
-        return mm_remove_node(root, bp);
+    size_t size;
+    int left, right;
+    void *m;
+
+    if (h == NULL)
+        return 1;
+
+    size = GETSIZE(h);
+    if (PARENT(h) != parent)
+        *errors += heap_error(h, "has a bad parent link");
+    if (GET_ALLOC(HDRP(h)) || size <= SEGLIMIT)
+        *errors += heap_error(h, "does not belong in the free tree");
+    if (size < lo || size > hi)
+        *errors += heap_error(h, "is out of order in the free tree");
+    for (m = h; m != NULL; m = NEXT(m)) {
+        if (m != h && (GET_ALLOC(HDRP(m)) || GETSIZE(m) != size))
+            *errors += heap_error(m, "does not belong in its chain");
+        (*count)++;
+    }
 
-    else if(mm_children(bp) == 1)
-        return mm_remove_child(root, bp);
+    left = check_tree(LEFT(h), h, lo, size - 1, count, errors);
+    right = check_tree(RIGHT(h), h, size + 1, hi, count, errors);
+    if (left != right)
+        *errors += heap_error(h, "has subtrees of different black heights");
 
-    else
-        return mm_remove_children(root, bp);
+    return left + !IS_RED(h);
 }
 
+#if CHECKEVERY
 /*
- * mm_ceiling - Locate a node that best fits in a free block and return its pointer
+ * check_tick - Check a slice of the calling thread's arena every
+ *     CHECKEVERY calls
  */
-void * mm_ceiling(void* root, int size)
+static void check_tick(void)
 {
-    void* best_fit;
+    arena_t *a;
 
-    /* Retrieve the best fit, check its size and determine if it works */
-    
-    if(root == NULL)
-        return NULL;
-        
-    int root_size = GETSIZE(root);
-    
-    if(root_size  ==  size)
-        return root;
+    if (++check_ops % CHECKEVERY)
+        return;
+
+    a = arena_get();
+    pthread_mutex_lock(&a->lock);
+    check_slice(a, CHECKSLICE);
+    pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * check_slice - Check the next n blocks of arena a, whose lock is held,
+ *     starting where the last slice stopped and going round the arena's
+ *     segments from the latest one. Aborts on corruption.
+ */
+static void check_slice(arena_t *a, int n)
+{
+    char *bp = a->check_bp;
+    int errors = 0;
+
+    while (n-- > 0) {
+        if (bp == NULL) {
+            if (a->check_seg == NULL && (a->check_seg = a->last_seg) == NULL)
+                return;
+            bp = NEXT_BLKP(a->check_seg + DSIZE);
+        }
 
-    else if(root_size > size)
-        best_fit = mm_ceiling(LEFT(root), size);
+        /* The end of a segment moves the slice on to the previous one */
+        if (GET_SIZE(HDRP(bp)) == 0) {
+            if (!GET_ALLOC(HDRP(bp)))
+                errors += heap_error(bp, "is a bad epilogue");
+            a->check_seg = SEGLINK(a->check_seg);
+            bp = NULL;
+            continue;
+        }
 
-    else if (root_size < size)
-        best_fit = mm_ceiling(RIGHT(root), size);
+        errors += checkblock(a, bp);
+        bp = NEXT_BLKP(bp);
+    }
+    a->check_bp = bp;
 
-    /* Determine size of child and see if the node is a good fit */
-    if(best_fit == NULL)
-    {
-        if(root_size < size) /* If it's too small, return NULL */
-            return NULL;
-        else 
-            return root;
+    if (errors) {
+        fflush(stdout);
+        fprintf(stderr, "mm: heap check found %d errors\n", errors);
+        abort();
     }
-    else 
-        return best_fit;
-                    
+}
+#endif
+
+/*
+ * free_insert - Put a free block in its size class list or in the free tree
+ */
+static void free_insert(arena_t *a, void *bp)
+{
+    if (GETSIZE(bp) <= SEGLIMIT)
+        seg_insert(a, bp);
+    else
+        a->tree_root = mm_insert(a->tree_root, bp);
 }
 
+/*
+ * free_remove - Take a free block out of its size class list or the free tree
+ */
+static void free_remove(arena_t *a, void *bp)
+{
+    if (GETSIZE(bp) <= SEGLIMIT)
+        seg_remove(a, bp);
+    else
+        a->tree_root = mm_remove(a->tree_root, bp);
+}
 
 /*
- * mm_parent - Retrieve the parent node of a child node
+ * seg_alloc - Allocate a block of asize <= SEGLIMIT bytes from the size
+ *     class lists. An exact class hit is taken whole in O(1); otherwise
+ *     the smallest non-empty larger class is split. With ADDRORDER and
+ *     a hint, the block is the one of its list nearest the hint. Returns
+ *     NULL if no size class can serve the request.
  */
-void *mm_parent(void *root, void *bp)
+static void *seg_alloc(arena_t *a, size_t asize)
 {
-    if(bp == root)
+    int cls = CLASS(asize);
+    unsigned long long larger;
+    void *bp = a->seg_lists[cls];
+
+    if (bp != NULL) {
+#if ADDRORDER
+        bp = mm_nearest(bp, a->hint);
+#endif
+        a->seg_hits[cls]++;
+        seg_remove(a, bp);
+        PUT(HDRP(bp), PACK(asize, 1|PREVALLOC));
+        SET_PREVALLOC(NEXT_BLKP(bp));
+        return bp;
+    }
+
+    a->seg_misses[cls]++;
+
+    larger = a->seg_map & ~((2ULL << cls) - 1);
+    if (larger == 0)
         return NULL;
 
-    if(GETSIZE(bp) <= GETSIZE(root))
-    {
-        if(LEFT(root) == bp)
-            return root;
-        else
-            return mm_parent(LEFT(root),bp);
+    bp = a->seg_lists[__builtin_ctzll(larger)];
+#if ADDRORDER
+    bp = mm_nearest(bp, a->hint);
+#endif
+    seg_remove(a, bp);
+    return place(a, bp, asize);
+}
+
+/*
+ * seg_insert - Push a free block on the front of its size class list,
+ *     or with ADDRORDER put it in its place in address order
+ */
+static void seg_insert(arena_t *a, void *bp)
+{
+    int cls = CLASS(GETSIZE(bp));
+    void *head = a->seg_lists[cls];
+#if ADDRORDER
+    void *prev = NULL;
+    int n = 0;
+
+    while (head != NULL && (char *)head < (char *)bp &&
+           (ADDRSCAN == 0 || n++ < ADDRSCAN)) {
+        prev = head;
+        head = NEXT(head);
     }
-    else
-    {
-        if(RIGHT(root) == bp)
-            return root;
-        else
-            return mm_parent(RIGHT(root),bp);
+    SETPREV(bp, prev);
+    SETNEXT(bp, head);
+    if (head != NULL)
+        SETPREV(head, bp);
+    if (prev != NULL) {
+        SETNEXT(prev, bp);
+        return;
     }
-} 
+#else
+    SETPREV(bp, NULL);
+    SETNEXT(bp, head);
+    if (head != NULL)
+        SETPREV(head, bp);
+#endif
+
+    a->seg_lists[cls] = bp;
+    a->seg_map |= 1ULL << cls;
+}
 
 /*
- * mm_children - Return the number of children under a given root node
+ * seg_remove - Unlink a free block from its size class list
  */
-int mm_children(void *root)
+static void seg_remove(arena_t *a, void *bp)
 {
-    int child_num = 0;
+    int cls = CLASS(GETSIZE(bp));
 
-    /* Do we have any children on either side? */
+    if (PREV(bp) == NULL)
+        a->seg_lists[cls] = NEXT(bp);
+    else
+        SETNEXT(PREV(bp), NEXT(bp));
+
+    if (NEXT(bp) != NULL)
+        SETPREV(NEXT(bp), PREV(bp));
+
+    if (a->seg_lists[cls] == NULL)
+        a->seg_map &= ~(1ULL << cls);
+}
 
-    if(LEFT(root) != NULL)
-         child_num++;
-    if(RIGHT(root) != NULL)
-         child_num++;
-                            
-    return child_num;
-}         
+/*
+ * The free blocks are kept in a red-black tree keyed on block size.
+ * Every tree node stores a PARENT link next to LEFT and RIGHT, so a node
+ * can be unlinked without searching for it from the root. Sizes in the
+ * tree are unique: a block whose size is already present is chained off
+ * that size's tree node through NEXT, uses its LEFT word as a back
+ * pointer (PREV) and has a NULL PARENT. The color of a tree node lives
+ * in bit 2 of its header (RED). With ADDRORDER the tree node is the lowest
+ * addressed block of its size and its chain ascends from there.
+ */
 
 /*
- * mm_remove_node - If a given node has no children, lets remove it.
+ * mm_insert - Insert a free block into the Red-Black Tree and return the new root
  */
-void *mm_remove_node(void *root, void *bp)
+void *mm_insert(void *root, void *bp)
 {
-    void *parent_node = mm_parent(root, bp);
-    
-    if(parent_node != NULL)
+    void *parent = NULL;
+    void *h = root;
+    size_t size = GETSIZE(bp);
+#if ADDRORDER
+    int n;
+#endif
+
+    /* Find the insertion point, or the tree node of the same size */
+
+    while(h != NULL)
     {
-        if(LEFT(parent_node) == bp) 
-            SETLEFT(parent_node, NULL);
-        else 
-            SETRIGHT(parent_node, NULL);
-        return root;
-    } 
+        if(size == GETSIZE(h))
+        {
+#if ADDRORDER
+            /* A lower block takes over the tree node ... */
+            if((char *)bp < (char *)h)
+            {
+                root = mm_replace(root, h, bp);
+                SETNEXT(bp, h);
+                SETPREV(h, bp);
+                SETPARENT(h, NULL);
+                return root;
+            }
+
+            /* ... a higher one goes to its place in the chain */
+            for(n = 0; NEXT(h) != NULL && (char *)NEXT(h) < (char *)bp &&
+                    (ADDRSCAN == 0 || n < ADDRSCAN); n++)
+                h = NEXT(h);
+#endif
+            /* Chain bp right behind h */
+            SETPREV(bp, h);
+            SETPARENT(bp, NULL);
+            SETNEXT(bp, NEXT(h));
+            if(NEXT(h) != NULL)
+                SETPREV(NEXT(h), bp);
+            SETNEXT(h, bp);
+            return root;
+        }
+
+        parent = h;
+        if(size < GETSIZE(h))
+            h = LEFT(h);
+        else
+            h = RIGHT(h);
+    }
+
+    /* Hang bp below parent as a new red leaf */
+
+    SETLEFT(bp, NULL);
+    SETRIGHT(bp, NULL);
+    SETPARENT(bp, parent);
+    SETNEXT(bp, NULL);
+    SET_RED(bp);
+
+    if(parent == NULL)
+        root = bp;
+    else if(size < GETSIZE(parent))
+        SETLEFT(parent, bp);
     else
+        SETRIGHT(parent, bp);
+
+    return mm_insert_fixup(root, bp);
+}
+
+/*
+ * mm_insert_fixup - Restore the red-black invariants after inserting bp
+ */
+void *mm_insert_fixup(void *root, void *bp)
+{
+    while(IS_RED(PARENT(bp)))
     {
-        return NULL;
+        void *parent = PARENT(bp);
+        void *grand = PARENT(parent);
+        void *uncle;
+
+        if(parent == LEFT(grand))
+        {
+            uncle = RIGHT(grand);
+            if(IS_RED(uncle))
+            {
+                SET_BLACK(parent);
+                SET_BLACK(uncle);
+                SET_RED(grand);
+                bp = grand;
+                continue;
+            }
+            if(bp == RIGHT(parent))
+            {
+                bp = parent;
+                root = mm_rotate_left(root, bp);
+                parent = PARENT(bp);
+            }
+            SET_BLACK(parent);
+            SET_RED(grand);
+            root = mm_rotate_right(root, grand);
+        }
+        else
+        {
+            uncle = LEFT(grand);
+            if(IS_RED(uncle))
+            {
+                SET_BLACK(parent);
+                SET_BLACK(uncle);
+                SET_RED(grand);
+                bp = grand;
+                continue;
+            }
+            if(bp == LEFT(parent))
+            {
+                bp = parent;
+                root = mm_rotate_right(root, bp);
+                parent = PARENT(bp);
+            }
+            SET_BLACK(parent);
+            SET_RED(grand);
+            root = mm_rotate_left(root, grand);
+        }
     }
+
+    SET_BLACK(root);
+
+    return root;
 }
 
 /*
- * mm_remove_child - Remove the node from the Binary Tree as long as it has one child
+ * mm_remove - Remove a free block from the Red-Black Tree and return the new root
  */
-void *mm_remove_child(void *root, void* bp)
+void *mm_remove(void *root, void *bp)
 {
-    void *parent_node = mm_parent(root, bp);
+    void *next = NEXT(bp);
     void *child;
-    
-    /* Who is our child? Where is it? */
+    void *parent;
+    int black;
 
-    if(LEFT(bp) != NULL)
-        child = LEFT(bp);
-    else
-        child = RIGHT(bp);
+    /* bp is chained behind a tree node: just unlink it */
 
-    if(parent_node != NULL)
+    if(PARENT(bp) == NULL && bp != root)
     {
-        if(LEFT(parent_node) == bp)
-            SETLEFT(parent_node, child);
-        else 
-            SETRIGHT(parent_node, child); 
+        SETNEXT(CHAINPREV(bp), next);
+        if(next != NULL)
+            SETPREV(next, CHAINPREV(bp));
         return root;
     }
+
+    /* bp is a tree node with a chain: promote the first chained block */
+
+    if(next != NULL)
+        return mm_replace(root, bp, next);
+
+    /* bp is the only block of its size: delete the tree node */
+
+    black = !IS_RED(bp);
+
+    if(LEFT(bp) == NULL)
+    {
+        child = RIGHT(bp);
+        parent = PARENT(bp);
+        root = mm_transplant(root, bp, child);
+    }
+    else if(RIGHT(bp) == NULL)
+    {
+        child = LEFT(bp);
+        parent = PARENT(bp);
+        root = mm_transplant(root, bp, child);
+    }
     else
     {
-        return child;                               
+        /* Put the smallest node of the right subtree in bp's place */
+        void *min = mm_min(RIGHT(bp));
+
+        black = !IS_RED(min);
+        child = RIGHT(min);
+
+        if(PARENT(min) == bp)
+            parent = min;
+        else
+        {
+            parent = PARENT(min);
+            root = mm_transplant(root, min, child);
+            SETRIGHT(min, RIGHT(bp));
+            SETPARENT(RIGHT(min), min);
+        }
+
+        root = mm_transplant(root, bp, min);
+        SETLEFT(min, LEFT(bp));
+        SETPARENT(LEFT(min), min);
+        COPY_COLOR(min, bp);
     }
+
+    if(black)
+        root = mm_remove_fixup(root, child, parent);
+
+    return root;
 }
 
 /*
- * mm_remove_children - Remove the node from the Binary Tree as long as it has two children
+ * mm_remove_fixup - Restore the red-black invariants after removing a black
+ *                   node; bp (possibly NULL) is the child that took its place
  */
-void *mm_remove_children(void *root, void *bp)
+void *mm_remove_fixup(void *root, void *bp, void *parent)
 {
-    void *parent_node = mm_parent(root, bp);
-    void *replacement = mm_replace(LEFT(bp));
-    void *new_bp;
-    
-    /* Remove the replacement and store the new bp */
+    void *sibling;
 
-    new_bp = mm_remove(LEFT(bp), replacement);
-    
-    SETLEFT(replacement, new_bp);
-    SETRIGHT(replacement, RIGHT(bp));
-    
-    if(parent_node != NULL) 
+    while(bp != root && !IS_RED(bp))
     {
-        if(LEFT(parent_node) == bp)
-            SETLEFT(parent_node, replacement);
+        if(bp == LEFT(parent))
+        {
+            sibling = RIGHT(parent);
+            if(IS_RED(sibling))
+            {
+                SET_BLACK(sibling);
+                SET_RED(parent);
+                root = mm_rotate_left(root, parent);
+                sibling = RIGHT(parent);
+            }
+            if(!IS_RED(LEFT(sibling)) && !IS_RED(RIGHT(sibling)))
+            {
+                SET_RED(sibling);
+                bp = parent;
+                parent = PARENT(bp);
+                continue;
+            }
+            if(!IS_RED(RIGHT(sibling)))
+            {
+                SET_BLACK(LEFT(sibling));
+                SET_RED(sibling);
+                root = mm_rotate_right(root, sibling);
+                sibling = RIGHT(parent);
+            }
+            COPY_COLOR(sibling, parent);
+            SET_BLACK(parent);
+            SET_BLACK(RIGHT(sibling));
+            root = mm_rotate_left(root, parent);
+        }
         else
-            SETRIGHT(parent_node, replacement);
-        return root;
+        {
+            sibling = LEFT(parent);
+            if(IS_RED(sibling))
+            {
+                SET_BLACK(sibling);
+                SET_RED(parent);
+                root = mm_rotate_right(root, parent);
+                sibling = LEFT(parent);
+            }
+            if(!IS_RED(LEFT(sibling)) && !IS_RED(RIGHT(sibling)))
+            {
+                SET_RED(sibling);
+                bp = parent;
+                parent = PARENT(bp);
+                continue;
+            }
+            if(!IS_RED(LEFT(sibling)))
+            {
+                SET_BLACK(RIGHT(sibling));
+                SET_RED(sibling);
+                root = mm_rotate_left(root, sibling);
+                sibling = LEFT(parent);
+            }
+            COPY_COLOR(sibling, parent);
+            SET_BLACK(parent);
+            SET_BLACK(LEFT(sibling));
+            root = mm_rotate_right(root, parent);
+        }
+        bp = root;
     }
-    else
+
+    if(bp != NULL)
+        SET_BLACK(bp);
+
+    return root;
+}
+
+/*
+ * mm_ceiling - Locate the smallest free block of at least size bytes and return its pointer.
+ *     Adds the number of tree nodes visited to *visits.
+ */
+void *mm_ceiling(void *root, size_t size, long *visits)
+{
+    void *best_fit = NULL;
+
+    /* Walk down the tree remembering the tightest fit seen so far */
+
+    while(root != NULL)
     {
-        return replacement; 
+        size_t root_size = GETSIZE(root);
+
+        (*visits)++;
+
+        if(root_size == size)
+        {
+            best_fit = root;
+            break;
+        }
+        else if(root_size > size)
+        {
+            best_fit = root;
+            root = LEFT(root);
+        }
+        else
+            root = RIGHT(root);
     }
+
+#if !ADDRORDER
+    /* Prefer a chained block, removing it does not touch the tree */
+
+    if(best_fit != NULL && NEXT(best_fit) != NULL)
+        return NEXT(best_fit);
+#endif
+
+    return best_fit;
 }
 
 /*
- * mm_replace - Locate the replacement for the parents' two children
+ * mm_nearest - Return the block of h's chain or size class list nearest
+ *     to near, or h itself, the lowest addressed one, if near is NULL.
+ *     The list behind h must be in address order; only its first
+ *     ADDRSCAN blocks are looked at.
  */
-void *mm_replace(void *bp)
+void *mm_nearest(void *h, void *near)
 {
-     if(RIGHT(bp) == NULL)
-        return bp;
-     else
-        return mm_replace(RIGHT(bp));
-}
\ No newline at end of file
+    void *next;
+    int n = 0;
+
+    if(near == NULL)
+        return h;
+
+    /* Walk up to the last block below near, then pick the closer neighbour */
+
+    while((next = NEXT(h)) != NULL && (char *)next < (char *)near &&
+          (ADDRSCAN == 0 || n++ < ADDRSCAN))
+        h = next;
+
+    if(next != NULL && (char *)next - (char *)near < (char *)near - (char *)h)
+        return next;
+
+    return h;
+}
+
+/*
+ * mm_replace - Put bp, a block of the same size, in tree node h's place,
+ *     and return the new root. The chains of both are left alone.
+ */
+void *mm_replace(void *root, void *h, void *bp)
+{
+    SETLEFT(bp, LEFT(h));
+    SETRIGHT(bp, RIGHT(h));
+    SETPARENT(bp, PARENT(h));
+    COPY_COLOR(bp, h);
+    if(LEFT(bp) != NULL)
+        SETPARENT(LEFT(bp), bp);
+    if(RIGHT(bp) != NULL)
+        SETPARENT(RIGHT(bp), bp);
+    return mm_transplant(root, h, bp);
+}
+
+/*
+ * mm_transplant - Replace the subtree rooted at bp by the one rooted at
+ *                 child in bp's parent, and return the new root
+ */
+void *mm_transplant(void *root, void *bp, void *child)
+{
+    void *parent = PARENT(bp);
+
+    if(parent == NULL)
+        root = child;
+    else if(LEFT(parent) == bp)
+        SETLEFT(parent, child);
+    else
+        SETRIGHT(parent, child);
+
+    if(child != NULL)
+        SETPARENT(child, parent);
+
+    return root;
+}
+
+/*
+ * mm_min - Return the smallest node of a subtree
+ */
+void *mm_min(void *h)
+{
+    while(LEFT(h) != NULL)
+        h = LEFT(h);
+
+    return h;
+}
+
+/*
+ * mm_rotate_left - Rotate the right child of h above it, and return the new root
+ */
+void *mm_rotate_left(void *root, void *h)
+{
+    void *x = RIGHT(h);
+
+    SETRIGHT(h, LEFT(x));
+    if(LEFT(x) != NULL)
+        SETPARENT(LEFT(x), h);
+
+    root = mm_transplant(root, h, x);
+
+    SETLEFT(x, h);
+    SETPARENT(h, x);
+
+    return root;
+}
+
+/*
+ * mm_rotate_right - Rotate the left child of h above it, and return the new root
+ */
+void *mm_rotate_right(void *root, void *h)
+{
+    void *x = LEFT(h);
+
+    SETLEFT(h, RIGHT(x));
+    if(RIGHT(x) != NULL)
+        SETPARENT(RIGHT(x), h);
+
+    root = mm_transplant(root, h, x);
+
+    SETRIGHT(x, h);
+    SETPARENT(h, x);
+
+    return root;
+}
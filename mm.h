@@ -6,6 +6,97 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 
+/* 
+ * mm_malloc, placed near hint when mm.c is built with ADDRORDER. The
+ * hint applies to every size below the mapping threshold (32KB), small
+ * size class requests included; mapped requests ignore it.
+ */
+extern void *mm_malloc_near(size_t size, void *hint);
+
+/* size bytes at a multiple of align, a power of two */
+extern void *mm_memalign(size_t align, size_t size);
+/* Payload bytes that block ptr can hold, at least the size it asked for */
+extern size_t mm_usable_size(void *ptr);
+
+/* n blocks of size bytes at once; returns how many were allocated */
+extern int mm_malloc_batch(size_t size, int n, void **ptrs);
+/* Free n blocks at once; reorders ptrs */
+extern void mm_free_batch(void **ptrs, int n);
+
+/* 
+ * mm_malloc_fixed(size) - mm_malloc for a size known at compile time.
+ * MM_BLOCKSIZE and MM_CLASS fold to constants, so a small request goes
+ * straight to its size class through mm_malloc_class, skipping the size
+ * adjustment, the mapping threshold and the free tree. A size only known
+ * at run time, or past MM_FIXEDLIMIT, takes mm_malloc. The layout here
+ * mirrors mm.c, which refuses to build if the two disagree.
+ */
+#define MM_WSIZE     sizeof(void *)
+#define MM_DSIZE     (2 * MM_WSIZE)
+#define MM_MINBLOCK  (MM_DSIZE * ((16 + 2*MM_DSIZE - 1) / MM_DSIZE))
+#define MM_FIXEDLIMIT 512   /* largest block mm_malloc_class serves */
+#define MM_BLOCKSIZE(size) ((size) + MM_WSIZE <= MM_MINBLOCK ? MM_MINBLOCK : \
+    MM_DSIZE * (((size) + MM_WSIZE + MM_DSIZE-1) / MM_DSIZE))
+#define MM_CLASS(size) ((int)((MM_BLOCKSIZE(size) - MM_MINBLOCK) / MM_DSIZE))
+
+/* A block of size class cls, MM_MINBLOCK + cls*MM_DSIZE bytes in all */
+extern void *mm_malloc_class(int cls);
+
+#define mm_malloc_fixed(size) \
+    ((__builtin_constant_p(size) && (size) > 0 && \
+      MM_BLOCKSIZE(size) <= MM_FIXEDLIMIT) ? \
+     mm_malloc_class(MM_CLASS(size)) : mm_malloc(size))
+
+/* 
+ * Regions: allocations that all die together. mm_region_alloc bumps a
+ * pointer; mm_region_destroy releases them all in one call, whose cost
+ * is one free per chunk of the region (REGIONCHUNK bytes, see mm.c,
+ * or one large allocation), not constant time. Region memory
+ * must not be passed to mm_free or mm_realloc, and a region must not be
+ * used by two threads at the same time.
+ */
+typedef struct mm_region mm_region_t;
+extern mm_region_t *mm_region_create(void);
+extern void *mm_region_alloc(mm_region_t *r, size_t size);
+extern void mm_region_destroy(mm_region_t *r);
+
+/* Check the heap, printing what is wrong; returns the number of errors */
+extern int mm_checkheap(int verbose);
+
+/* Block size and hit/miss counts of size class cls; 0 past the last class */
+extern int mm_seg_stats(int cls, size_t *size, long *hits, long *misses);
+
+/* 
+ * Allocator-internal statistics since the last mm_init. The event
+ * counters accumulate; the free block fields describe the heap at the
+ * time of the mm_stats call.
+ */
+#define MM_SIZEBINS 16
+typedef struct {
+    long ceiling_calls;      /* free tree searches */
+    long ceiling_visits;     /* tree nodes visited by those searches */
+    long split_front;        /* splits leaving the allocation in front */
+    long split_back;         /* splits leaving the allocation at the back */
+    long coalesce[4];        /* coalesce cases 1-4: none, next, prev, both */
+    long extends;            /* heap extensions */
+    long trims;              /* heap shrinks */
+    long mmaps;              /* blocks given a mapping of their own */
+    long remaps;             /* resizes of those mappings */
+    long realloc_inplace;    /* reallocs that kept their block */
+    long realloc_prev;       /* reallocs that slid into a free predecessor */
+    long realloc_copy;       /* reallocs that moved their data */
+    long quick_hits;         /* mallocs served from the deferred frees */
+    long quick_misses;       /* mallocs that found no deferred free */
+    long quick_flushes;      /* batches of deferred frees coalesced */
+    int tree_depth;          /* longest root to leaf path of any free tree */
+    long free_blocks;        /* free blocks in the heap */
+    size_t free_bytes;       /* bytes in those blocks */
+    size_t free_largest;     /* the largest of those blocks */
+    long free_bins[MM_SIZEBINS]; /* free blocks of size [2^(i+4), 2^(i+5)) */
+} mm_stats_t;
+
+extern void mm_stats(mm_stats_t *stats);
+
 
 /* 
  * Students work in teams of one or two.  Teams enter their team name, 
@@ -35,11 +35,15 @@ team_t team = {
     ""
 };
 
-/* single word (4) or double word (8) alignment */
+/* double word alignment: 8 bytes in a 32-bit build, 16 in a 64-bit one */
+#ifdef __LP64__
+#define ALIGNMENT 16
+#else
 #define ALIGNMENT 8
+#endif
 
 /* rounds up to the nearest multiple of ALIGNMENT */
-#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
 
 
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
@@ -60,7 +64,7 @@ void *mm_malloc(size_t size)
 {
     int newsize = ALIGN(size + SIZE_T_SIZE);
     void *p = mem_sbrk(newsize);
-    if ((int)p == -1)
+    if (p == (void *)-1)
 	return NULL;
     else {
         *(size_t *)p = size;
@@ -95,6 +99,135 @@ void *mm_realloc(void *ptr, size_t size)
     return newptr;
 }
 
+/*
+ * mm_memalign - Allocate align extra bytes and round the block pointer
+ *     up; blocks are never freed, so its start is never needed again
+ */
+void *mm_memalign(size_t align, size_t size)
+{
+    char *p;
+
+    if (align <= ALIGNMENT)
+      return mm_malloc(size);
+    if ((p = mm_malloc(size + align)) == NULL)
+      return NULL;
+    p = (char *)(((size_t)p + align-1) & ~(align-1));
+    *(size_t *)(p - SIZE_T_SIZE) = size;
+    return p;
+}
+
+/*
+ * mm_usable_size - Exactly the size the block was allocated with
+ */
+size_t mm_usable_size(void *ptr)
+{
+    return *(size_t *)((char *)ptr - SIZE_T_SIZE);
+}
+
+/*
+ * mm_malloc_near - There is no placement to steer, so the hint is ignored
+ */
+void *mm_malloc_near(size_t size, void *hint)
+{
+    return mm_malloc(size);
+}
+
+/*
+ * mm_malloc_batch - Implemented simply as n calls to mm_malloc
+ */
+int mm_malloc_batch(size_t size, int n, void **ptrs)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+      if ((ptrs[i] = mm_malloc(size)) == NULL)
+        break;
+    return i;
+}
+
+/*
+ * mm_malloc_class - Implemented simply as mm_malloc of the largest
+ *     payload that fits the class's block
+ */
+void *mm_malloc_class(int cls)
+{
+    return mm_malloc(MM_MINBLOCK + cls * MM_DSIZE - MM_WSIZE);
+}
+
+/*
+ * mm_free_batch - Implemented simply as n calls to mm_free
+ */
+void mm_free_batch(void **ptrs, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+      mm_free(ptrs[i]);
+}
+
+/*
+ * Regions - Each allocation is its own block, linked to the region's
+ *     previous one through the word before its payload
+ */
+struct mm_region {
+    void *last;
+};
+
+mm_region_t *mm_region_create(void)
+{
+    mm_region_t *r = mm_malloc(sizeof(mm_region_t));
+
+    if (r != NULL)
+      r->last = NULL;
+    return r;
+}
+
+void *mm_region_alloc(mm_region_t *r, size_t size)
+{
+    char *p = mm_malloc(size + ALIGNMENT);
+
+    if (p == NULL)
+      return NULL;
+    *(void **)p = r->last;
+    r->last = p;
+    return p + ALIGNMENT;
+}
+
+void mm_region_destroy(mm_region_t *r)
+{
+    void *p, *next;
+
+    for (p = r->last; p != NULL; p = next) {
+      next = *(void **)p;
+      mm_free(p);
+    }
+    mm_free(r);
+}
+
+/*
+ * mm_checkheap - There is nothing to check in this package.
+ */
+int mm_checkheap(int verbose)
+{
+    return 0;
+}
+
+/*
+ * mm_stats - There is nothing to count in this package.
+ */
+void mm_stats(mm_stats_t *stats)
+{
+    memset(stats, 0, sizeof(mm_stats_t));
+}
+
+/*
+ * mm_seg_stats - There are no size classes in this package
+ */
+int mm_seg_stats(int cls, size_t *size, long *hits, long *misses)
+{
+    return 0;
+}
+
 
 
 
@@ -0,0 +1,635 @@
+/*
+ * mmtrace.c - Record the allocation requests of a live process as a
+ *     trace that mdriver can replay
+ *
+ *     MMTRACE=app.rep LD_PRELOAD=./libmmtrace.so program ...
+ *
+ * malloc, free, realloc, reallocarray, calloc and the aligned
+ * allocators are passed on to the C library's allocator and logged on
+ * the way. Each thread
+ * logs into a buffer of its own and shares nothing with the others but
+ * an atomic sequence number per request. Full buffers go on a lock-free
+ * list that a background thread writes to MMTRACE.raw. At exit the raw
+ * log is put back in sequence, pointers are turned into block ids and
+ * the trace is written to MMTRACE (default mmtrace.rep): as text, or
+ * in the binary format of trace.h if the name ends in ".bin". A %p in
+ * the name becomes the process id, for programs that exec others under
+ * the same environment.
+ *
+ * Requests of a multithreaded process are tagged with the thread that
+ * made them (see trace.h), so mdriver -T -P replays each thread on a
+ * thread of its own. Frees of blocks allocated before recording began
+ * are left out, and blocks still live at exit are freed at the end of
+ * the trace, as in tracegen's traces. A forked child is not recorded.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+#define BUFEVENTS 8192      /* requests per thread buffer */
+#define FLUSHNSEC 10000000  /* the writer thread wakes every 10ms */
+#define MAXPATH   4096
+
+/* 
+ * The id map key of a block whose address was handed out again before
+ * its realloc made it into the sequence; blocks are at least 8-byte
+ * aligned, so it never clashes with a block's own address
+ */
+#define MOVED(p)  ((void *)((char *)(p) + 1))
+
+/* The C library's allocator, which does the real work */
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+/* One logged request; ALLOC and REALLOC are logged once they return */
+typedef struct {
+    unsigned long seq;   /* position in the process's request stream */
+    void *ptr;           /* block returned or freed, NULL for a gap */
+    void *old;           /* block a realloc resized */
+    size_t size;         /* requested bytes */
+    int type;            /* ALLOC, FREE or REALLOC */
+    int tid;             /* thread that made the request */
+} event_t;
+
+typedef struct buf {
+    struct buf *next;    /* next buffer awaiting the writer */
+    int count;           /* events logged */
+    event_t ev[BUFEVENTS];
+} buf_t;
+
+/* Every thread that logged, so exit can collect their last buffers */
+typedef struct thread {
+    struct thread *next;
+    buf_t *volatile buf; /* buffer being filled */
+    int tid;
+} thread_t;
+
+static volatile int recording;      /* set while requests are logged */
+static unsigned long next_seq;      /* sequence numbers handed out */
+static int next_tid;                /* thread numbers handed out */
+static buf_t *volatile full;        /* full buffers awaiting the writer */
+static thread_t *volatile threads;  /* every thread that logged */
+static volatile int stopping;       /* tells the writer to quit */
+static pthread_t writer;
+static pthread_key_t thread_key;
+static int raw_fd = -1;
+static char trace_path[MAXPATH], raw_path[MAXPATH + 4];
+
+static __thread thread_t *self;
+static __thread int busy;           /* set while we call into libc ourselves */
+
+/* Pointer to block id map and the free ids, used at exit */
+static void **map_keys;
+static int *map_ids;
+static size_t map_cap, map_len;
+static int *free_ids;
+static int num_free, max_free, num_ids;
+
+/*
+ * buf_new - A fresh buffer, straight from the kernel
+ */
+static buf_t *buf_new(void)
+{
+    buf_t *b = mmap(NULL, sizeof(buf_t), PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return (b == MAP_FAILED) ? NULL : b;
+}
+
+/*
+ * buf_push - Hand buffer b to the writer
+ */
+static void buf_push(buf_t *b)
+{
+    do {
+	b->next = full;
+    } while (!__sync_bool_compare_and_swap(&full, b->next, b));
+}
+
+/*
+ * thread_exit - Hand the exiting thread's last buffer to the writer
+ */
+static void thread_exit(void *arg)
+{
+    thread_t *t = arg;
+    buf_t *b = __sync_lock_test_and_set(&t->buf, NULL);
+
+    if (b != NULL)
+	buf_push(b);
+}
+
+/*
+ * thread_start - Number the calling thread and register it; returns -1
+ *     if it cannot log
+ */
+static int thread_start(void)
+{
+    thread_t *t;
+
+    if ((t = __libc_malloc(sizeof(thread_t))) == NULL)
+	return -1;
+    t->buf = NULL;
+    t->tid = __sync_fetch_and_add(&next_tid, 1);
+    do {
+	t->next = threads;
+    } while (!__sync_bool_compare_and_swap(&threads, t->next, t));
+    pthread_setspecific(thread_key, t);
+    self = t;
+    return 0;
+}
+
+/*
+ * record - Log a request of the calling thread
+ */
+static void record(int type, void *ptr, void *old, size_t size)
+{
+    buf_t *b;
+    event_t *e;
+
+    if (!recording || busy)
+	return;
+    busy = 1;
+
+    if (self == NULL && thread_start() < 0) {
+	busy = 0;
+	return;
+    }
+    if ((b = self->buf) == NULL || b->count == BUFEVENTS) {
+	if (b != NULL)
+	    buf_push(b);
+	if ((self->buf = b = buf_new()) == NULL) {
+	    busy = 0;
+	    return;
+	}
+    }
+
+    e = &b->ev[b->count];
+    e->seq = __sync_fetch_and_add(&next_seq, 1);
+    e->ptr = ptr;
+    e->old = old;
+    e->size = size;
+    e->type = type;
+    e->tid = self->tid;
+    b->count++;
+
+    busy = 0;
+}
+
+/*
+ * write_buf - Append the events of buffer b to the raw log
+ */
+static void write_buf(buf_t *b)
+{
+    char *p = (char *)b->ev;
+    size_t left = b->count * sizeof(event_t);
+    ssize_t n;
+
+    while (left > 0 && (n = write(raw_fd, p, left)) > 0) {
+	p += n;
+	left -= n;
+    }
+}
+
+/*
+ * write_full - Write out and release every full buffer
+ */
+static void write_full(void)
+{
+    buf_t *b, *next;
+
+    for (b = __sync_lock_test_and_set(&full, NULL); b != NULL; b = next) {
+	next = b->next;
+	write_buf(b);
+	munmap(b, sizeof(buf_t));
+    }
+}
+
+/*
+ * write_thread - Write out full buffers as they come in
+ */
+static void *write_thread(void *arg)
+{
+    struct timespec ts = {0, FLUSHNSEC};
+
+    busy = 1;
+    while (!stopping) {
+	nanosleep(&ts, NULL);
+	write_full();
+    }
+    return NULL;
+}
+
+/*
+ * fork_child - Forked children do not record, and have no writer
+ */
+static void fork_child(void)
+{
+    recording = 0;
+}
+
+/*
+ * start - Open the raw log and start the writer before main runs
+ */
+__attribute__((constructor))
+static void start(void)
+{
+    char *name = getenv("MMTRACE");
+    char *pid;
+
+    if (name == NULL)
+	name = "mmtrace.rep";
+    if ((pid = strstr(name, "%p")) != NULL)
+	snprintf(trace_path, MAXPATH, "%.*s%d%s", (int)(pid - name), name,
+		 (int)getpid(), pid + 2);
+    else
+	snprintf(trace_path, MAXPATH, "%s", name);
+    snprintf(raw_path, sizeof(raw_path), "%s.raw", trace_path);
+
+    busy = 1;
+    if ((raw_fd = open(raw_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+	fprintf(stderr, "mmtrace: could not create %s\n", raw_path);
+	busy = 0;
+	return;
+    }
+    pthread_key_create(&thread_key, thread_exit);
+    pthread_atfork(NULL, NULL, fork_child);
+    if (pthread_create(&writer, NULL, write_thread, NULL) != 0) {
+	fprintf(stderr, "mmtrace: could not start the writer thread\n");
+	close(raw_fd);
+	unlink(raw_path);
+	busy = 0;
+	return;
+    }
+    busy = 0;
+    recording = 1;
+}
+
+/*
+ * map_home - The slot where the id map's probe for block p starts
+ */
+static size_t map_home(void *p)
+{
+    size_t h = (size_t)p * 0x9e3779b97f4a7c15ULL;
+
+    return (h ^ (h >> 29)) & (map_cap - 1);
+}
+
+/*
+ * map_slot - The slot of block p in the id map, or of the gap where it
+ *     would go
+ */
+static size_t map_slot(void *p)
+{
+    size_t i = map_home(p);
+
+    while (map_keys[i] != NULL && map_keys[i] != p)
+	i = (i + 1) & (map_cap - 1);
+    return i;
+}
+
+/*
+ * map_put - Map block p to id, doubling the map when it is half full
+ */
+static void map_put(void *p, int id)
+{
+    void **keys = map_keys;
+    int *ids = map_ids;
+    size_t cap = map_cap, i, j;
+
+    if (2 * (map_len + 1) > map_cap) {
+	map_cap = cap ? 2 * cap : 1024;
+	map_keys = calloc(map_cap, sizeof(void *));
+	map_ids = malloc(map_cap * sizeof(int));
+	if (map_keys == NULL || map_ids == NULL) {
+	    fprintf(stderr, "mmtrace: out of memory\n");
+	    exit(1);
+	}
+	for (i = 0; i < cap; i++) {
+	    if (keys[i] != NULL) {
+		j = map_slot(keys[i]);
+		map_keys[j] = keys[i];
+		map_ids[j] = ids[i];
+	    }
+	}
+	free(keys);
+	free(ids);
+    }
+
+    i = map_slot(p);
+    if (map_keys[i] == NULL)
+	map_len++;
+    map_keys[i] = p;
+    map_ids[i] = id;
+}
+
+/*
+ * map_take - Remove block p from the map and return its id, or -1 if
+ *     it is not there; later entries of its probe run shift back
+ */
+static int map_take(void *p)
+{
+    size_t i, j, k;
+    int id;
+
+    if (map_cap == 0 || map_keys[i = map_slot(p)] == NULL)
+	return -1;
+    id = map_ids[i];
+    map_len--;
+
+    for (j = (i + 1) & (map_cap - 1); map_keys[j] != NULL;
+	 j = (j + 1) & (map_cap - 1)) {
+	k = map_home(map_keys[j]);
+	/* An entry may fill the hole unless its home lies in (i, j] */
+	if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+	    map_keys[i] = map_keys[j];
+	    map_ids[i] = map_ids[j];
+	    i = j;
+	}
+    }
+    map_keys[i] = NULL;
+    return id;
+}
+
+/*
+ * id_new - A block id, reusing freed ones first
+ */
+static int id_new(void)
+{
+    return num_free > 0 ? free_ids[--num_free] : num_ids++;
+}
+
+/*
+ * id_free - Make id reusable
+ */
+static void id_free(int id)
+{
+    if (num_free == max_free) {
+	max_free = max_free ? 2 * max_free : 1024;
+	if ((free_ids = realloc(free_ids, max_free * sizeof(int))) == NULL) {
+	    fprintf(stderr, "mmtrace: out of memory\n");
+	    exit(1);
+	}
+    }
+    free_ids[num_free++] = id;
+}
+
+/*
+ * add_op - Append a request to ops, which has room for it
+ */
+static void add_op(traceop_t *ops, int *n, int type, int index, size_t size,
+		   int tid)
+{
+    traceop_t *op = &ops[(*n)++];
+
+    op->type = type;
+    op->index = index;
+    op->size = (size > 0) ? size : 1;   /* mm_malloc(0) fails in mdriver */
+    op->count = 1;
+    op->tid = tid;
+}
+
+/*
+ * convert - Turn the raw log into the trace. Events go back in sequence
+ *     by their sequence numbers. Frees are numbered before the block
+ *     goes back to libc, so a block is never handed out again ahead of
+ *     its free; but a realloc is numbered once it returns, after libc
+ *     has released the old block, and another thread may already have
+ *     been given that address and numbered its request. The old block
+ *     then stays live under its MOVED key until its realloc comes up.
+ */
+static void convert(unsigned long total)
+{
+    struct stat st;
+    event_t *raw, *ev, *e;
+    traceop_t *ops;
+    bintrace_hdr_t hdr;
+    FILE *out;
+    long n;
+    size_t i;
+    int num_ops = 0, id, binary, tagged = (next_tid > 1);
+    char tag[16];
+    size_t len;
+
+    if (fstat(raw_fd, &st) < 0 || total == 0)
+	return;
+    n = st.st_size / sizeof(event_t);
+    raw = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, raw_fd, 0);
+    ev = calloc(total, sizeof(event_t));
+    ops = malloc((2 * total + 1) * sizeof(traceop_t));
+    if (raw == MAP_FAILED || ev == NULL || ops == NULL) {
+	fprintf(stderr, "mmtrace: out of memory, raw log left in %s\n", raw_path);
+	return;
+    }
+    for (i = 0; i < n; i++)
+	if (raw[i].seq < total)
+	    ev[raw[i].seq] = raw[i];
+
+    for (e = ev; e < ev + total; e++) {
+	if (e->ptr == NULL || e->size > INT_MAX)
+	    continue;
+	switch (e->type) {
+	case ALLOC:
+	    /* Still live: the old block of a realloc not yet in sequence */
+	    if ((id = map_take(e->ptr)) >= 0) {
+		if (map_keys[map_slot(MOVED(e->ptr))] == NULL)
+		    map_put(MOVED(e->ptr), id);
+		else {
+		    add_op(ops, &num_ops, FREE, id, 0, e->tid);
+		    id_free(id);
+		}
+	    }
+	    id = id_new();
+	    map_put(e->ptr, id);
+	    add_op(ops, &num_ops, ALLOC, id, e->size, e->tid);
+	    break;
+	case FREE:
+	    if ((id = map_take(e->ptr)) >= 0) {
+		add_op(ops, &num_ops, FREE, id, 0, e->tid);
+		id_free(id);
+	    }
+	    break;
+	case REALLOC:
+	    /* A block from before recording began is new to the trace */
+	    if ((id = map_take(MOVED(e->old))) < 0 &&
+		(id = map_take(e->old)) < 0) {
+		id = id_new();
+		map_put(e->ptr, id);
+		add_op(ops, &num_ops, ALLOC, id, e->size, e->tid);
+		break;
+	    }
+	    map_put(e->ptr, id);
+	    add_op(ops, &num_ops, REALLOC, id, e->size, e->tid);
+	    break;
+	}
+    }
+
+    /* Free what is still live, all from the first thread */
+    for (i = 0; i < map_cap; i++)
+	if (map_keys[i] != NULL)
+	    add_op(ops, &num_ops, FREE, map_ids[i], 0, 0);
+
+    len = strlen(trace_path);
+    binary = (len > 4 && !strcmp(trace_path + len - 4, ".bin"));
+    if ((out = fopen(trace_path, "w")) == NULL) {
+	fprintf(stderr, "mmtrace: could not create %s, raw log left in %s\n",
+		trace_path, raw_path);
+	return;
+    }
+    if (binary) {
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = BINTRACE_MAGIC;
+	hdr.version = BINTRACE_VERSION;
+	hdr.num_ids = num_ids;
+	hdr.num_ops = num_ops;
+	hdr.weight = 1;
+	for (i = 0; i < num_ops; i++)
+	    if (!tagged)
+		ops[i].tid = -1;
+	fwrite(&hdr, sizeof(hdr), 1, out);
+	fwrite(ops, sizeof(traceop_t), num_ops, out);
+    }
+    else {
+	fprintf(out, "0\n%d\n%d\n1\n", num_ids, num_ops);
+	for (i = 0; i < num_ops; i++) {
+	    tag[0] = '\0';
+	    if (tagged)
+		snprintf(tag, sizeof(tag), ":%d", ops[i].tid);
+	    if (ops[i].type == FREE)
+		fprintf(out, "f%s %d\n", tag, ops[i].index);
+	    else
+		fprintf(out, "%c%s %d %d\n", ops[i].type == ALLOC ? 'a' : 'r',
+			tag, ops[i].index, ops[i].size);
+	}
+    }
+    fclose(out);
+    unlink(raw_path);
+    fprintf(stderr, "mmtrace: %d requests of %d threads in %s\n",
+	    num_ops, next_tid, trace_path);
+}
+
+/*
+ * finish - Stop recording, write out every buffer and build the trace
+ */
+__attribute__((destructor))
+static void finish(void)
+{
+    thread_t *t;
+    buf_t *b;
+
+    if (!recording)
+	return;
+    recording = 0;
+    busy = 1;
+
+    stopping = 1;
+    pthread_join(writer, NULL);
+    write_full();
+
+    /* Threads still running may touch their buffer, so it stays mapped */
+    for (t = threads; t != NULL; t = t->next)
+	if ((b = __sync_lock_test_and_set(&t->buf, NULL)) != NULL)
+	    write_buf(b);
+
+    convert(next_seq);
+    close(raw_fd);
+}
+
+void *malloc(size_t size)
+{
+    void *p = __libc_malloc(size);
+
+    if (p != NULL)
+	record(ALLOC, p, NULL, size);
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL)
+	return;
+    record(FREE, ptr, NULL, 0);
+    __libc_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *p;
+
+    if (ptr != NULL && size == 0) {
+	record(FREE, ptr, NULL, 0);
+	return __libc_realloc(ptr, 0);
+    }
+    if ((p = __libc_realloc(ptr, size)) != NULL)
+	record(ptr ? REALLOC : ALLOC, p, ptr, size);
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *p = __libc_calloc(nmemb, size);
+
+    if (p != NULL)
+	record(ALLOC, p, NULL, nmemb * size);
+    return p;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    void *p = __libc_memalign(alignment, size);
+
+    if (p != NULL)
+	record(ALLOC, p, NULL, size);
+    return p;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    if (size && nmemb > (size_t)-1 / size) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+	return EINVAL;
+    if ((p = memalign(alignment, size)) == NULL)
+	return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+
+    return memalign(pagesize, (size + pagesize-1) & ~(pagesize-1));
+}
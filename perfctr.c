@@ -0,0 +1,105 @@
+/*
+ * perfctr.c - Count hardware events used by a function f
+ *
+ * Each event gets its own perf_event_open counter on the calling
+ * thread, user mode only, so that an unprivileged process can use
+ * them (perf_event_paranoid <= 2). Counters are scaled by
+ * time_enabled/time_running in case the kernel had to multiplex them.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perfctr.h"
+
+char *perf_event_names[PERF_EVENTS] = {
+    "cycles", "instrs", "L1d", "LLC", "dTLB", "brmiss"
+};
+
+/* perf_event_attr type and config of each event */
+#define CACHE_MISS(cache)  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+			    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+static struct {
+    unsigned type;
+    unsigned long long config;
+} events[PERF_EVENTS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+    {PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static int fds[PERF_EVENTS] = {-1, -1, -1, -1, -1, -1};
+
+/* 
+ * perf_open - Open one disabled counter per event; returns how many
+ *     the kernel and the CPU support 
+ */
+int perf_open(void)
+{
+    struct perf_event_attr attr;
+    int i, n = 0;
+
+    for (i = 0; i < PERF_EVENTS; i++) {
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+	    PERF_FORMAT_TOTAL_TIME_RUNNING;
+	fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fds[i] >= 0)
+	    n++;
+    }
+    return n;
+}
+
+/* 
+ * perf_close - Close the counters opened by perf_open 
+ */
+void perf_close(void)
+{
+    int i;
+
+    for (i = 0; i < PERF_EVENTS; i++) {
+	if (fds[i] >= 0)
+	    close(fds[i]);
+	fds[i] = -1;
+    }
+}
+
+/* 
+ * perf_count - Count the events during one call of f(argp)
+ */
+void perf_count(perf_test_funct f, void *argp, double counts[PERF_EVENTS])
+{
+    unsigned long long val[3]; /* value, time enabled, time running */
+    int i;
+
+    for (i = 0; i < PERF_EVENTS; i++) {
+	if (fds[i] >= 0) {
+	    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+	    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+    }
+    f(argp);
+    for (i = 0; i < PERF_EVENTS; i++)
+	if (fds[i] >= 0)
+	    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+    for (i = 0; i < PERF_EVENTS; i++) {
+	counts[i] = -1;
+	if (fds[i] < 0 || read(fds[i], val, sizeof(val)) != sizeof(val))
+	    continue;
+	if (val[2] > 0) /* else it was never scheduled on the CPU */
+	    counts[i] = (double)val[0] * val[1] / val[2];
+    }
+}
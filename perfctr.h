@@ -0,0 +1,29 @@
+/*
+ * perfctr.h - hardware performance counters around a test function,
+ *     read with perf_event_open (Linux only)
+ */
+
+/* The events we count, in the order of the counts arrays */
+#define PERF_CYCLES       0
+#define PERF_INSTRUCTIONS 1
+#define PERF_L1D_MISSES   2
+#define PERF_LLC_MISSES   3
+#define PERF_DTLB_MISSES  4
+#define PERF_BRANCH_MISSES 5
+#define PERF_EVENTS       6
+
+/* Short column names for the events */
+extern char *perf_event_names[PERF_EVENTS];
+
+/* The test function takes a generic pointer as input */
+typedef void (*perf_test_funct)(void *);
+
+/* Open the counters; returns how many of the events are available */
+int perf_open(void);
+
+/* Close whatever perf_open opened */
+void perf_close(void);
+
+/* Count the events during one call of f(argp). Events that could not
+   be opened get a count of -1. */
+void perf_count(perf_test_funct f, void *argp, double counts[PERF_EVENTS]);
@@ -0,0 +1,122 @@
+/*
+ * rep2bin.c - Convert a text .rep trace into the binary trace format
+ *     of trace.h, which mdriver mmaps instead of parsing
+ *
+ * Usage: rep2bin <in.rep> <out.bin>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define MAXLINE 1024
+
+static void app_error(char *msg, char *path)
+{
+    fprintf(stderr, "rep2bin: %s: %s\n", path, msg);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    bintrace_hdr_t hdr;
+    traceop_t *ops;
+    char type[MAXLINE];
+    unsigned index, size, count;
+    int max_index = -1;
+    int tagged = 0, batched = 0;
+    int i;
+
+    if (argc != 3) {
+	fprintf(stderr, "Usage: rep2bin <in.rep> <out.bin>\n");
+	exit(1);
+    }
+
+    if ((in = fopen(argv[1], "r")) == NULL)
+	app_error("could not open", argv[1]);
+
+    /* Read the trace file header */
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = BINTRACE_MAGIC;
+    hdr.version = BINTRACE_VERSION;
+    if (fscanf(in, "%d %d %d %d", &hdr.sugg_heapsize, &hdr.num_ids,
+	       &hdr.num_ops, &hdr.weight) != 4 || hdr.num_ops < 0)
+	app_error("bad trace header", argv[1]);
+
+    if ((ops = (traceop_t *)calloc(hdr.num_ops, sizeof(traceop_t))) == NULL)
+	app_error("out of memory", argv[1]);
+
+    /* Read every request line in the trace file */
+    for (i = 0; i < hdr.num_ops; i++) {
+	if (fscanf(in, "%s", type) != 1)
+	    app_error("fewer requests than the header says", argv[1]);
+
+	count = 1;
+	switch (type[0]) {
+	case 'a':
+	case 'r':
+	    if (fscanf(in, "%u %u", &index, &size) != 2)
+		app_error("bad alloc/realloc request", argv[1]);
+	    ops[i].type = (type[0] == 'a') ? ALLOC : REALLOC;
+	    ops[i].size = size;
+	    break;
+	case 'f':
+	    if (fscanf(in, "%u", &index) != 1)
+		app_error("bad free request", argv[1]);
+	    ops[i].type = FREE;
+	    break;
+	case 'A':
+	    if (fscanf(in, "%u %u %u", &index, &count, &size) != 3 || count == 0)
+		app_error("bad batch alloc request", argv[1]);
+	    ops[i].type = ALLOC_BATCH;
+	    ops[i].size = size;
+	    break;
+	case 'F':
+	    if (fscanf(in, "%u %u", &index, &count) != 2 || count == 0)
+		app_error("bad batch free request", argv[1]);
+	    ops[i].type = FREE_BATCH;
+	    break;
+	default:
+	    app_error("bogus request type", argv[1]);
+	}
+
+	/* "x:tid" names the thread that issues the request */
+	ops[i].tid = -1;
+	if (type[1] == ':') {
+	    if (type[0] == 'A' || type[0] == 'F' || 
+		sscanf(type + 2, "%d", &ops[i].tid) != 1 || ops[i].tid < 0)
+		app_error("bad thread tag", argv[1]);
+	    tagged = 1;
+	}
+	if (type[0] == 'A' || type[0] == 'F')
+	    batched = 1;
+
+	if (index >= (unsigned)hdr.num_ids || 
+	    count > (unsigned)hdr.num_ids - index)
+	    app_error("block id out of range", argv[1]);
+	ops[i].index = index;
+	ops[i].count = count;
+	index += count - 1;
+	max_index = ((int)index > max_index) ? (int)index : max_index;
+    }
+    if (fscanf(in, "%s", type) == 1)
+	app_error("more requests than the header says", argv[1]);
+    fclose(in);
+
+    if (max_index != hdr.num_ids - 1)
+	app_error("header id count does not match the requests", argv[1]);
+    if (tagged && batched)
+	app_error("thread tags and batch requests do not mix", argv[1]);
+
+    if ((out = fopen(argv[2], "wb")) == NULL)
+	app_error("could not create", argv[2]);
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+	fwrite(ops, sizeof(traceop_t), hdr.num_ops, out) != (size_t)hdr.num_ops ||
+	fclose(out) != 0)
+	app_error("write failed", argv[2]);
+
+    free(ops);
+    return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * trace.h - Trace requests and the binary trace file format
+ *
+ * A binary trace is a bintrace_hdr_t followed by num_ops traceop_t
+ * records exactly as they are laid out in memory, so mdriver can mmap
+ * the file and replay the records in place. The file uses the byte
+ * order and int size of the machine that wrote it; rep2bin converts a
+ * text .rep trace.
+ *
+ * A text trace has one request per line after its header: "a id size",
+ * "r id size" and "f id", plus "A id n size" and "F id n" to allocate
+ * or free the n blocks id through id+n-1 in one batch call. Writing the
+ * request letter as "a:t", "r:t" or "f:t" tags it with the thread t that
+ * issues it in a partitioned multithreaded replay (mdriver -T -P), so a
+ * block may be freed by another thread than the one that allocated it.
+ * Batch requests take no tag, and a trace that tags any request may not
+ * contain batches.
+ */
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#define BINTRACE_MAGIC   0x5254424d  /* "MBTR" */
+#define BINTRACE_VERSION 3
+
+/* 
+ * Characterizes a single trace operation (allocator request). A batch
+ * request covers the count consecutive block ids starting at index.
+ */
+typedef struct {
+    enum {ALLOC, FREE, REALLOC, ALLOC_BATCH, FREE_BATCH} type; /* type of request */
+    int index;                        /* index for free() to use later */
+    int size;                         /* byte size of alloc/realloc request */
+    int count;                        /* number of blocks, 1 unless a batch */
+    int tid;                          /* issuing thread, -1 to go by index */
+} traceop_t;
+
+/* Fixed header of a binary trace file */
+typedef struct {
+    unsigned magic;      /* BINTRACE_MAGIC */
+    unsigned version;    /* BINTRACE_VERSION */
+    int sugg_heapsize;   /* suggested heap size (unused) */
+    int num_ids;         /* number of alloc/realloc ids */
+    int num_ops;         /* number of traceop_t records that follow */
+    int weight;          /* weight for this trace (unused) */
+} bintrace_hdr_t;
+
+#endif /* __TRACE_H_ */
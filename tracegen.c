@@ -0,0 +1,410 @@
+/*
+ * tracegen.c - Generate a synthetic trace from parameterized
+ *     distributions, as a text .rep trace or, if the output name ends
+ *     in ".bin", as a binary trace (see trace.h)
+ *
+ * Usage: tracegen [-n <ops>] [-S <hist>] [-L <dist>] [-r <realloc>]
+ *                 [-t <threads>] [-s <seed>] <out>
+ *
+ * The trace is a sequence of time steps, one request each. A step frees
+ * or reallocs the block whose event is due, if any, and otherwise
+ * allocates a new block with a size drawn from the histogram and a
+ * lifetime (in steps) drawn from the lifetime distribution. Toward the
+ * end no more blocks are allocated, so that the trace frees everything
+ * it allocated within the requested number of ops. Block ids
+ * are recycled once freed, so num_ids tracks the peak live block count
+ * rather than the trace length, and traces of 10^8 requests replay in
+ * a modest id table.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "trace.h"
+
+#define MAXBUCKETS 64    /* entries in a size histogram */
+#define MAXSIZE    (1<<28) /* reallocs never grow a block past this */
+
+/* Kinds of event in the queue */
+#define EV_REALLOC 0     /* sorts first, so a realloc never follows its free */
+#define EV_FREE    1
+
+/* A pending realloc or free of one block */
+typedef struct {
+    long time;           /* step at which it is due */
+    int kind;            /* EV_REALLOC or EV_FREE */
+    int id;              /* block it acts on */
+} event_t;
+
+/* Size histogram: sizes are uniform in (max[i-1], max[i]] */
+static int num_buckets;
+static int bucket_max[MAXBUCKETS];
+static double bucket_cum[MAXBUCKETS]; /* cumulative weights, last is 1 */
+
+/* Lifetime distribution, in steps */
+static enum {LIFE_FIXED, LIFE_UNIFORM, LIFE_EXP, LIFE_PARETO} life_kind;
+static double life_a, life_b;
+
+/* Realloc growth: a fraction of blocks grow steps times by factor */
+static double grow_frac, grow_factor;
+static int grow_steps;
+
+/* Producer/consumer threads: a fraction of frees go to another thread */
+static int threads;
+static double cross_frac;
+
+/* Event queue, a binary min-heap on (time, kind) */
+static event_t *queue;
+static long queue_len, queue_cap;
+
+/* Per-id state, and the stack of ids free for reuse */
+static int *id_size;     /* current block size */
+static int *id_owner;    /* thread that allocated it */
+static int *id_stack;
+static int id_cap, id_top, num_ids;
+
+static unsigned long long rng = 88172645463325252ULL;
+
+static void usage(void)
+{
+    fprintf(stderr,
+	    "Usage: tracegen [-n <ops>] [-S <hist>] [-L <dist>] [-r <realloc>]\n"
+	    "                [-t <threads>] [-s <seed>] <out>\n"
+	    "Options\n"
+	    "\t-n <ops>       Number of requests, e.g. 1e7 (default 1e6).\n"
+	    "\t-S <hist>      Size histogram max:weight,... (default\n"
+	    "\t               16:20,64:35,256:25,1024:12,8192:6,65536:2).\n"
+	    "\t-L <dist>      Lifetime in requests: fixed:<n>, uniform:<lo>:<hi>,\n"
+	    "\t               exp:<mean> or pareto:<min>:<alpha> (default exp:1000).\n"
+	    "\t-r <realloc>   frac:factor:steps, e.g. 0.05:1.5:4 makes 5%% of\n"
+	    "\t               the blocks grow 4 times by 1.5x (default none).\n"
+	    "\t-t <threads>   n:frac tags requests with n producer threads and\n"
+	    "\t               hands frac of the frees to another one.\n"
+	    "\t-s <seed>      Random seed.\n"
+	    "\t<out>          Output trace; binary if it ends in .bin.\n");
+    exit(1);
+}
+
+static void app_error(char *msg)
+{
+    fprintf(stderr, "tracegen: %s\n", msg);
+    exit(1);
+}
+
+/*
+ * uniform - xorshift64*, scaled to [0, 1)
+ */
+static double uniform(void)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (double)((rng * 2685821657736338717ULL) >> 11) / (double)(1ULL << 53);
+}
+
+/*
+ * parse_hist - Parse a "max:weight,..." histogram with increasing maxes
+ */
+static void parse_hist(char *spec)
+{
+    char *tok;
+    double w, total = 0;
+    int max, i;
+
+    num_buckets = 0;
+    for (tok = strtok(spec, ","); tok != NULL; tok = strtok(NULL, ",")) {
+	if (num_buckets == MAXBUCKETS || sscanf(tok, "%d:%lf", &max, &w) != 2 ||
+	    max < 1 || w < 0 ||
+	    (num_buckets > 0 && max <= bucket_max[num_buckets-1]))
+	    app_error("bad size histogram");
+	bucket_max[num_buckets] = max;
+	total += w;
+	bucket_cum[num_buckets++] = total;
+    }
+    if (num_buckets == 0 || total == 0)
+	app_error("bad size histogram");
+    for (i = 0; i < num_buckets; i++)
+	bucket_cum[i] /= total;
+}
+
+/*
+ * parse_life - Parse a lifetime distribution
+ */
+static void parse_life(char *spec)
+{
+    if (sscanf(spec, "fixed:%lf", &life_a) == 1 && life_a >= 1)
+	life_kind = LIFE_FIXED;
+    else if (sscanf(spec, "uniform:%lf:%lf", &life_a, &life_b) == 2 &&
+	     life_a >= 1 && life_b >= life_a)
+	life_kind = LIFE_UNIFORM;
+    else if (sscanf(spec, "exp:%lf", &life_a) == 1 && life_a > 0)
+	life_kind = LIFE_EXP;
+    else if (sscanf(spec, "pareto:%lf:%lf", &life_a, &life_b) == 2 &&
+	     life_a >= 1 && life_b > 0)
+	life_kind = LIFE_PARETO;
+    else
+	app_error("bad lifetime distribution");
+}
+
+/*
+ * draw_size - Draw a request size from the histogram
+ */
+static int draw_size(void)
+{
+    double u = uniform();
+    int i, lo;
+
+    for (i = 0; i < num_buckets - 1 && u >= bucket_cum[i]; i++)
+	;
+    lo = (i == 0) ? 1 : bucket_max[i-1] + 1;
+    return lo + (int)(uniform() * (bucket_max[i] - lo + 1));
+}
+
+/*
+ * draw_life - Draw a lifetime of at least one step
+ */
+static long draw_life(void)
+{
+    double l;
+
+    switch (life_kind) {
+    case LIFE_FIXED:
+	l = life_a;
+	break;
+    case LIFE_UNIFORM:
+	l = life_a + uniform() * (life_b - life_a + 1);
+	break;
+    case LIFE_EXP:
+	l = -life_a * log(1 - uniform());
+	break;
+    default:
+	l = life_a / pow(1 - uniform(), 1 / life_b);
+	break;
+    }
+    if (l > 1e15)
+	l = 1e15;
+    return (l < 1) ? 1 : (long)l;
+}
+
+/*
+ * before - Does event a come before event b?
+ */
+static int before(event_t *a, event_t *b)
+{
+    return a->time < b->time || (a->time == b->time && a->kind < b->kind);
+}
+
+/*
+ * push_event - Insert an event into the queue
+ */
+static void push_event(long time, int kind, int id)
+{
+    event_t e;
+    long i;
+
+    if (queue_len == queue_cap) {
+	queue_cap = queue_cap ? 2 * queue_cap : 1024;
+	if ((queue = realloc(queue, queue_cap * sizeof(event_t))) == NULL)
+	    app_error("out of memory");
+    }
+    e.time = time;
+    e.kind = kind;
+    e.id = id;
+    for (i = queue_len++; i > 0 && before(&e, &queue[(i-1)/2]); i = (i-1)/2)
+	queue[i] = queue[(i-1)/2];
+    queue[i] = e;
+}
+
+/*
+ * pop_event - Remove the earliest event from the queue
+ */
+static event_t pop_event(void)
+{
+    event_t top = queue[0], last = queue[--queue_len];
+    long i = 0, c;
+
+    while ((c = 2*i + 1) < queue_len) {
+	if (c + 1 < queue_len && before(&queue[c+1], &queue[c]))
+	    c++;
+	if (!before(&queue[c], &last))
+	    break;
+	queue[i] = queue[c];
+	i = c;
+    }
+    queue[i] = last;
+    return top;
+}
+
+/*
+ * new_id - Take a free block id, growing the id tables if need be
+ */
+static int new_id(void)
+{
+    if (id_top > 0)
+	return id_stack[--id_top];
+    if (num_ids == id_cap) {
+	id_cap = id_cap ? 2 * id_cap : 1024;
+	if ((id_size = realloc(id_size, id_cap * sizeof(int))) == NULL ||
+	    (id_owner = realloc(id_owner, id_cap * sizeof(int))) == NULL ||
+	    (id_stack = realloc(id_stack, id_cap * sizeof(int))) == NULL)
+	    app_error("out of memory");
+    }
+    return num_ids++;
+}
+
+/*
+ * emit - Write one request, as a text line or a binary record
+ */
+static void emit(FILE *out, int binary, int type, int id, int size, int tid)
+{
+    static char letter[] = {'a', 'f', 'r'};
+    traceop_t op;
+
+    if (binary) {
+	memset(&op, 0, sizeof(op));
+	op.type = type;
+	op.index = id;
+	op.size = size;
+	op.count = 1;
+	op.tid = tid;
+	if (fwrite(&op, sizeof(op), 1, out) != 1)
+	    app_error("write failed");
+	return;
+    }
+    fputc(letter[type], out);
+    if (tid >= 0)
+	fprintf(out, ":%d", tid);
+    if (type == FREE)
+	fprintf(out, " %d\n", id);
+    else
+	fprintf(out, " %d %d\n", id, size);
+}
+
+/*
+ * write_header - Write the trace header at the start of out. The text
+ *     header is padded to a fixed width so it can be rewritten in place
+ *     once num_ids is known.
+ */
+static void write_header(FILE *out, int binary, long ops)
+{
+    bintrace_hdr_t hdr;
+
+    rewind(out);
+    if (binary) {
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = BINTRACE_MAGIC;
+	hdr.version = BINTRACE_VERSION;
+	hdr.num_ids = num_ids;
+	hdr.num_ops = ops;
+	hdr.weight = 1;
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+	    app_error("write failed");
+    }
+    else
+	fprintf(out, "%-11d\n%-11d\n%-11ld\n%-11d\n", 0, num_ids, ops, 1);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *out;
+    char hist[] = "16:20,64:35,256:25,1024:12,8192:6,65536:2";
+    long ops = 1000000;  /* requests to generate */
+    long now, n, live = 0, life;
+    double grown;
+    event_t e;
+    int binary, draining, c, id, tid, j;
+
+    parse_hist(hist);
+    parse_life("exp:1000");
+    while ((c = getopt(argc, argv, "n:S:L:r:t:s:h")) != EOF) {
+	switch (c) {
+	case 'n':
+	    if ((ops = strtod(optarg, NULL)) < 0 || ops > 0x7fffffffL)
+		app_error("-n must be in [0, 2^31)");
+	    break;
+	case 'S':
+	    parse_hist(optarg);
+	    break;
+	case 'L':
+	    parse_life(optarg);
+	    break;
+	case 'r':
+	    if (sscanf(optarg, "%lf:%lf:%d", &grow_frac, &grow_factor,
+		       &grow_steps) != 3 || grow_frac < 0 || grow_frac > 1 ||
+		grow_factor <= 0 || grow_steps < 0)
+		app_error("bad realloc pattern");
+	    break;
+	case 't':
+	    if (sscanf(optarg, "%d:%lf", &threads, &cross_frac) != 2 ||
+		threads < 1 || cross_frac < 0 || cross_frac > 1)
+		app_error("bad thread spec");
+	    break;
+	case 's':
+	    rng = strtoull(optarg, NULL, 0) * 2654435761ULL + 1;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind != argc - 1)
+	usage();
+    binary = strlen(argv[optind]) > 4 &&
+	!strcmp(argv[optind] + strlen(argv[optind]) - 4, ".bin");
+    if ((out = fopen(argv[optind], binary ? "wb" : "w")) == NULL)
+	app_error("could not create the output trace");
+    write_header(out, binary, ops);
+
+    for (now = 0, n = 0; n < ops; now++) {
+	/* Once the remaining steps are only enough to free the live
+	   blocks, every step frees the next one to die */
+	draining = (live >= ops - n - 1);
+
+	/* The due event, if any */
+	if (queue_len > 0 && (draining || queue[0].time <= now)) {
+	    e = pop_event();
+	    if (e.kind == EV_REALLOC) {
+		if (draining)
+		    continue;   /* no steps left to grow it */
+		grown = id_size[e.id] * grow_factor;
+		id_size[e.id] = (grown < 1) ? 1 : (grown > MAXSIZE) ? 
+		    MAXSIZE : (int)grown;
+		emit(out, binary, REALLOC, e.id, id_size[e.id], 
+		     id_owner[e.id]);
+		n++;
+		continue;
+	    }
+	    tid = id_owner[e.id];
+	    if (threads > 1 && uniform() < cross_frac)
+		tid = (tid + 1 + (int)(uniform() * (threads - 1))) % threads;
+	    emit(out, binary, FREE, e.id, 0, tid);
+	    id_stack[id_top++] = e.id;
+	    live--;
+	    n++;
+	    continue;
+	}
+	if (draining)
+	    break;              /* one step left, and nothing to free */
+
+	/* Otherwise a new block */
+	id = new_id();
+	id_size[id] = draw_size();
+	id_owner[id] = threads ? (int)(uniform() * threads) : -1;
+	emit(out, binary, ALLOC, id, id_size[id], id_owner[id]);
+	life = draw_life();
+	push_event(now + life, EV_FREE, id);
+	if (grow_steps > 0 && uniform() < grow_frac)
+	    for (j = 1; j <= grow_steps; j++)
+		if (life * j / (grow_steps + 1) > 0)
+		    push_event(now + life * j / (grow_steps + 1), 
+			       EV_REALLOC, id);
+	live++;
+	n++;
+    }
+
+    write_header(out, binary, n);
+    if (fclose(out) != 0)
+	app_error("write failed");
+    return 0;
+}